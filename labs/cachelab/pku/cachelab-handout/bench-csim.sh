@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# bench-csim.sh - Time csim-ref, csim-scalar and csim over a range of
+#     associativities on one synthetic trace.
+#
+#     csim-ref     the reference simulator
+#     csim-scalar  csim built without vector extensions
+#     csim         csim built with $(SIMD), see the Makefile
+#
+# Usage: ./bench-csim.sh [accesses]
+#
+
+ACCESSES=${1:-2000000}
+TRACE=trace.bench
+S=4
+B=5
+
+# Random loads and stores over a working set of about 2 * S * E blocks,
+# so every associativity sees a mix of hits, misses and evictions.
+awk -v n=$ACCESSES 'BEGIN {
+    srand(15213);
+    for (i = 0; i < n; i++) {
+        op = (rand() < 0.7) ? "L" : "S";
+        printf(" %s %x,4\n", op, int(rand() * 4096) * 32);
+    }
+}' > $TRACE
+
+now() { date +%s.%N; }
+declare -A t
+
+printf "%4s %12s %12s %12s %9s\n" "E" "csim-ref(s)" "scalar(s)" "simd(s)" "speedup"
+for E in 1 2 4 8 16 32 64; do
+    for sim in csim-ref csim-scalar csim; do
+        start=$(now)
+        ./$sim -s $S -E $E -b $B -t $TRACE > /dev/null
+        t[$sim]=$(awk -v a=$start -v b=$(now) 'BEGIN { print b - a }')
+    done
+    printf "%4d %12.3f %12.3f %12.3f %8.2fx\n" $E \
+        ${t[csim-ref]} ${t[csim-scalar]} ${t[csim]} \
+        $(awk -v a=${t[csim-ref]} -v b=${t[csim]} 'BEGIN { print a / b }')
+done
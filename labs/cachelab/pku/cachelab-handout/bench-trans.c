@@ -0,0 +1,254 @@
+/*
+ * bench-trans.c - Run the registered transpose functions natively on
+ *     large matrices and report wall time, bandwidth and the hardware
+ *     cache misses counted by perf_event_open(2), next to correctTrans
+ *     as the baseline.
+ *
+ * Unlike test-trans, which scores the functions by their misses on the
+ * simulated cache, this measures the same routines on the real machine,
+ * together with the kernels of trans-native.c.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "cachelab.h"
+#include "trans-native.h"
+
+/* Largest matrix side accepted with -S */
+#define MAXN 16384
+
+/* Smallest matrix side benchmarked */
+#define MINN 256
+
+/* External function defined in trans.c */
+extern void registerFunctions();
+
+/* External variables defined in cachelab.c */
+extern trans_func_t func_list[MAX_TRANS_FUNCS];
+extern int func_counter;
+
+/* The hardware events reported per run */
+enum { EV_LLC, EV_L1D, NEVENTS };
+
+static const char *event_names[NEVENTS] = { "LLC-miss", "L1D-miss" };
+
+static struct perf_event_attr event_attrs[NEVENTS] = {
+    [EV_LLC] = {
+        .type = PERF_TYPE_HARDWARE,
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+    },
+    [EV_L1D] = {
+        .type = PERF_TYPE_HW_CACHE,
+        .config = PERF_COUNT_HW_CACHE_L1D |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    },
+};
+
+static int event_fds[NEVENTS];
+
+/* Counters of one run; -1 if the event couldn't be opened */
+typedef struct {
+    double secs;
+    long long events[NEVENTS];
+} sample_t;
+
+/*
+ * open_events - Open one counter per event for this process and the
+ *     threads it creates afterwards. Missing events are left at -1.
+ */
+static void open_events(void)
+{
+    int i;
+
+    for (i = 0; i < NEVENTS; i++) {
+        struct perf_event_attr *attr = &event_attrs[i];
+        attr->size = sizeof(*attr);
+        attr->disabled = 1;
+        attr->inherit = 1;
+        attr->exclude_kernel = 1;
+        attr->exclude_hv = 1;
+        event_fds[i] = syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+    }
+}
+
+static void close_events(void)
+{
+    int i;
+
+    for (i = 0; i < NEVENTS; i++)
+        if (event_fds[i] >= 0)
+            close(event_fds[i]);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * measure - Run one transpose and sample time and counters around it
+ */
+static sample_t measure(void (*func)(int, int, int[][*], int[][*]),
+                        int M, int N, int *A, int *B)
+{
+    sample_t sample;
+    double start;
+    int i;
+
+    for (i = 0; i < NEVENTS; i++) {
+        if (event_fds[i] >= 0) {
+            ioctl(event_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(event_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    start = now();
+    (*func)(M, N, (int (*)[M])A, (int (*)[N])B);
+    sample.secs = now() - start;
+    for (i = 0; i < NEVENTS; i++) {
+        sample.events[i] = -1;
+        if (event_fds[i] >= 0) {
+            ioctl(event_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(event_fds[i], &sample.events[i], sizeof(long long))
+                != sizeof(long long))
+                sample.events[i] = -1;
+        }
+    }
+    return sample;
+}
+
+/*
+ * is_transposed - Check B against A
+ */
+static int is_transposed(int M, int N, int *A, int *B)
+{
+    long i, j;
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < M; j++)
+            if (A[i * M + j] != B[j * N + i])
+                return 0;
+    return 1;
+}
+
+/*
+ * bench - Time one function at one size, best of reps runs
+ */
+static void bench(const char *name, void (*func)(int, int, int[][*], int[][*]),
+                  int M, int N, int *A, int *B, int reps)
+{
+    sample_t best, cur;
+    int r, i;
+
+    memset(B, 0, sizeof(int) * (size_t)M * N);
+    best = measure(func, M, N, A, B);   /* also warms up the pages of B */
+    for (r = 1; r < reps; r++) {
+        cur = measure(func, M, N, A, B);
+        if (cur.secs < best.secs)
+            best = cur;
+    }
+
+    printf("  %-40.40s %10.3f %8.2f", name, best.secs * 1e3,
+           2.0 * sizeof(int) * M * N / best.secs / 1e9);
+    for (i = 0; i < NEVENTS; i++) {
+        if (best.events[i] >= 0)
+            printf(" %12lld", best.events[i]);
+        else
+            printf(" %12s", "-");
+    }
+    printf("  %s\n", is_transposed(M, N, A, B) ? "yes" : "no");
+}
+
+/*
+ * usage - Print usage info
+ */
+static void usage(char *argv[])
+{
+    printf("Usage: %s [-h] [-S <max>] [-r <reps>] [-n]\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -S <max>    Largest matrix side, from %d up to %d (default 4096)\n",
+           MINN, MAXN);
+    printf("  -r <reps>   Runs per function and size, best is kept (default 3)\n");
+    printf("  -n          Only the kernels of trans-native.c and correctTrans\n");
+    printf("Example: %s -S 16384 -r 1\n", argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    char c;
+    int max = 4096, reps = 3, native_only = 0;
+    int size, i;
+    size_t j;
+    int *A, *B;
+
+    while ((c = getopt(argc, argv, "S:r:nh")) != -1) {
+        switch (c) {
+        case 'S':
+            max = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'n':
+            native_only = 1;
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+
+    if (max < MINN || max > MAXN || reps < 1) {
+        usage(argv);
+        exit(1);
+    }
+
+    if (!native_only)
+        registerFunctions();
+    registerNativeFunctions();
+
+    A = malloc(sizeof(int) * (size_t)max * max);
+    B = malloc(sizeof(int) * (size_t)max * max);
+    if (A == NULL || B == NULL) {
+        fprintf(stderr, "Error: can't allocate two %dx%d matrices\n", max, max);
+        exit(1);
+    }
+
+    open_events();
+    if (event_fds[EV_LLC] < 0 && event_fds[EV_L1D] < 0)
+        printf("perf_event_open unavailable, cache misses not reported\n");
+
+    for (size = MINN; size <= max; size *= 2) {
+        for (j = 0; j < (size_t)size * size; j++)
+            A[j] = rand();
+
+        printf("\n%d x %d\n", size, size);
+        printf("  %-40s %10s %8s", "function", "ms", "GB/s");
+        for (i = 0; i < NEVENTS; i++)
+            printf(" %12s", event_names[i]);
+        printf("  %s\n", "valid");
+
+        bench("correctTrans (baseline)", correctTrans, size, size, A, B, reps);
+        for (i = 0; i < func_counter; i++)
+            bench(func_list[i].description, func_list[i].func_ptr,
+                  size, size, A, B, reps);
+    }
+
+    close_events();
+    free(A);
+    free(B);
+    return 0;
+}
@@ -40,6 +40,7 @@
  *	In function header comment, I've provided MORE DETAIL about hit and miss.
  *
  */
+#define _GNU_SOURCE
 #include "cachelab.h"
 #include <stdio.h>
 #include <string.h>
@@ -47,25 +48,57 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WAY_VECTOR	4	//	tags compared by one instruction
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define WAY_VECTOR	2
+#else
+#define WAY_VECTOR	1
+#endif
 
 
-typedef struct
-{
-	unsigned valid;		//	valid bit
-	int lastUsedTime;	//	LRU (least-recently used) replacement policy when choosing which cache line to evict.
-	unsigned long long cacheTag;	//	CT (cache tag)
-} Block;
 
+/*
+ *	Set layout
+ *
+ *		A set keeps its tags and its LRU stamps in two separate arrays
+ *	(struct of arrays), so the tags of a set are contiguous and CT can be
+ *	compared against WAY_VECTOR of them at once.
+ *
+ *		Ways are filled in order and are never invalidated, so the valid ways
+ *	of a set are always a prefix of it: setFill[i] is the length of that
+ *	prefix, and also the index of the first invalid way. Rows are padded to
+ *	a multiple of WAY_VECTOR, so the vector loop never leaves its row.
+ *
+ *		Stamps are 64 bits wide and don't overflow on long traces.
+ */
+typedef unsigned long long Stamp;
 
-int s = -1, E = -1, b = -1, verbosity = 0;
+
+int s = -1, E = -1, b = -1, verbosity = 0, threads = 1;
 
 int hit = 0, miss = 0, eviction = 0;
 
-int overAllTime = 0;
+Stamp overAllTime = 0;
 
 
-Block *cachePool;
+unsigned long long *cacheTags;	//	CT (cache tag), wayStride per set
+Stamp *lastUsedTime;	//	LRU (least-recently used) replacement policy when choosing which cache line to evict.
+unsigned *setFill;	//	number of valid ways in each set
+int wayStride;
+
+
+/*
+ *	The outcome of a single visitation, OR-ed together.
+ */
+#define RESULT_HIT		1
+#define RESULT_MISS		2
+#define RESULT_EVICTION	4
 
 
 
@@ -82,11 +115,13 @@ void displayHelp(char* argv[], int ERROR)
     puts("    -E <num>   Number of lines per set.");
     puts("    -b <num>   Number of block offset bits.");
     puts("    -t <file>  Trace file.");
+    puts("    -p <num>   Number of worker threads (default 1).");
     puts("");
     puts("");
     puts("    Examples:");
     printf("    %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
     printf("    %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("    %s -p 8 -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
     if (ERROR)
     {
     	exit(1);
@@ -119,52 +154,320 @@ void displayHelp(char* argv[], int ERROR)
  *		2.2 	A cache with a least recently used (LRU) replacement policy
  *			would choose the block that was last accessed the furthest in the past.
  */
-void visitCache(unsigned long long address)
+/*
+ *	find the valid way holding cacheTag, return -1 if there isn't one.
+ */
+static inline int findWay(const unsigned long long *tags, int fill, unsigned long long cacheTag)
+{
+#if WAY_VECTOR == 4
+	__m256i key = _mm256_set1_epi64x((long long)cacheTag);
+	for (int i = 0; i < fill; i += 4)
+	{
+		__m256i way = _mm256_load_si256((const __m256i *)(tags + i));
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(way, key)));
+		if (fill - i < 4)
+			mask &= (1 << (fill - i)) - 1;	//	ignore the invalid ways
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif WAY_VECTOR == 2
+	__m128i key = _mm_set1_epi64x((long long)cacheTag);
+	for (int i = 0; i < fill; i += 2)
+	{
+		__m128i way = _mm_load_si128((const __m128i *)(tags + i));
+		int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(way, key)));
+		if (fill - i < 2)
+			mask &= 1;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	for (int i = 0; i < fill; ++i)
+		if (tags[i] == cacheTag)
+			return i;
+#endif
+	return -1;
+}
+
+int visitSet(unsigned cacheIndex, unsigned long long cacheTag, Stamp time)
+{
+	unsigned long long *tags = cacheTags + (size_t)wayStride * cacheIndex;
+	Stamp *stamps = lastUsedTime + (size_t)wayStride * cacheIndex;
+	int fill = setFill[cacheIndex];
+
+	int way = findWay(tags, fill, cacheTag);
+	if (way >= 0)	//	hit
+	{
+		stamps[way] = time;
+		return RESULT_HIT;
+	}
+
+	if (fill < E)	//	compulsory miss
+	{
+		tags[fill] = cacheTag;
+		stamps[fill] = time;
+		setFill[cacheIndex] = fill + 1;
+		return RESULT_MISS;
+	}
+
+	/*
+	 *	capacity miss, select the victim block
+	 */
+	int victim = 0;
+	for (int i = 1; i < E; ++i)
+		if (stamps[i] < stamps[victim])
+			victim = i;
+
+	tags[victim] = cacheTag;
+	stamps[victim] = time;
+	return RESULT_MISS | RESULT_EVICTION;
+}
+
+
+/*
+ *	Split an address into CT and CI, and visit the selected set.
+ */
+int visitCache(unsigned long long address)
 {
 	unsigned long long cacheTag = address >> b >> s;
 	unsigned cacheIndex = address >> b & ((1 << s) - 1);
-	
-	Block *cacherow = cachePool + E * cacheIndex;
-	Block *victimRow = cacherow;
-	for (int i = 0; i < E; ++i)
+
+	int result = visitSet(cacheIndex, cacheTag, overAllTime);
+
+	hit += (result & RESULT_HIT) != 0;
+	miss += (result & RESULT_MISS) != 0;
+	eviction += (result & RESULT_EVICTION) != 0;
+	return result;
+}
+
+
+/*
+ *	print a -v record in the same format as csim-ref.
+ */
+void printVerbose(char operation, unsigned long long address, unsigned size, int result)
+{
+	printf("%c %llx,%u ", operation, address, size);
+	if (result & RESULT_HIT)
+		printf("hit ");
+	if (result & RESULT_MISS)
+		printf("miss ");
+	if (result & RESULT_EVICTION)
+		printf("eviction ");
+	if (operation == 'M')
+		printf("hit ");
+	putchar('\n');
+}
+
+
+
+/*
+ *	Parallel simulation (-p <num>)
+ *
+ *		Under LRU an access only reads and updates the set selected by its
+ *	CI bits, so sets are independent of each other. The main thread streams
+ *	the trace and routes every access to the worker that owns its set; each
+ *	worker owns a disjoint, contiguous range of sets and replays its
+ *	own accesses in trace order. Every set therefore sees exactly the same
+ *	sequence of (tag, time) pairs as in the serial run, and the merged
+ *	counters are identical.
+ *
+ *		Accesses travel in batches through one single-producer /
+ *	single-consumer ring per worker, so the hot path has no locks and
+ *	touches the shared head/tail words once per BATCH_SIZE accesses.
+ *
+ *		For -v, each worker also appends its outcomes to a private log. As a
+ *	worker consumes its accesses in trace order, the main thread rebuilds
+ *	the serial output by taking the next outcome from the owning worker.
+ */
+#define BATCH_SIZE	4096
+#define QUEUE_DEPTH	8
+#define CACHE_LINE	64
+
+typedef struct
+{
+	unsigned long long cacheTag;
+	Stamp time;
+	unsigned cacheIndex;
+} Access;
+
+typedef struct
+{
+	Access access[BATCH_SIZE];
+	int count;
+} Batch;
+
+typedef struct
+{
+	unsigned head;		//	written by the producer only
+	char padHead[CACHE_LINE - sizeof(unsigned)];
+	unsigned tail;		//	written by the worker only
+	char padTail[CACHE_LINE - sizeof(unsigned)];
+	int done;
+
+	Batch batch[QUEUE_DEPTH];
+
+	int hit, miss, eviction;
+
+	unsigned char *outcome;	//	-v only : results in the worker's trace order
+	size_t outcomeCount, outcomeCapacity;
+
+	pthread_t tid;
+} Worker;
+
+typedef struct
+{
+	char operation;
+	unsigned long long address;
+	unsigned size;
+	int worker;
+} Record;
+
+
+Worker *workers;
+
+
+static inline int ownerOf(unsigned cacheIndex)
+{
+	return (int)(((unsigned long long)cacheIndex * threads) >> s);
+}
+
+void *workerRoutine(void *arg)
+{
+	Worker *w = (Worker *)arg;
+
+	for (;;)
 	{
-		if  (!cacherow[i].valid)	//	compulsory miss
+		unsigned head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+		if (w->tail == head)
 		{
-			++miss;
-			cacherow[i].valid = 1;
-			cacherow[i].lastUsedTime = overAllTime;
-			cacherow[i].cacheTag = cacheTag;
-			return;
+			if (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)
+				&& w->tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE))
+				break;
+			sched_yield();
+			continue;
 		}
-		
-		if  (cacherow[i].lastUsedTime && cacherow[i].cacheTag == cacheTag)	//	hit
+
+		Batch *batch = &w->batch[w->tail % QUEUE_DEPTH];
+		for (int i = 0; i < batch->count; ++i)
 		{
-			cacherow[i].lastUsedTime = overAllTime;
-			++hit;
-			return;
+			Access *a = batch->access + i;
+			int result = visitSet(a->cacheIndex, a->cacheTag, a->time);
+
+			w->hit += (result & RESULT_HIT) != 0;
+			w->miss += (result & RESULT_MISS) != 0;
+			w->eviction += (result & RESULT_EVICTION) != 0;
+
+			if (verbosity)
+			{
+				if (w->outcomeCount == w->outcomeCapacity)
+				{
+					w->outcomeCapacity = w->outcomeCapacity ? w->outcomeCapacity * 2 : BATCH_SIZE;
+					w->outcome = (unsigned char *) realloc(w->outcome, w->outcomeCapacity);
+					if (!w->outcome)
+					{
+						fprintf(stderr, "csim: out of memory\n");
+						exit(1);
+					}
+				}
+				w->outcome[w->outcomeCount++] = result;
+			}
 		}
 
-		if(cacherow[i].lastUsedTime < victimRow->lastUsedTime)	//	select the victim block
+		__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ *	hand the current batch to the worker, then wait for a free slot.
+ */
+void publishBatch(Worker *w)
+{
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+	while (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= QUEUE_DEPTH)
+		sched_yield();
+	w->batch[w->head % QUEUE_DEPTH].count = 0;
+}
+
+int pushAccess(unsigned long long address)
+{
+	unsigned cacheIndex = address >> b & ((1 << s) - 1);
+	int owner = ownerOf(cacheIndex);
+	Worker *w = workers + owner;
+	Batch *batch = &w->batch[w->head % QUEUE_DEPTH];
+
+	batch->access[batch->count].cacheTag = address >> b >> s;
+	batch->access[batch->count].time = overAllTime;
+	batch->access[batch->count].cacheIndex = cacheIndex;
+	if (++batch->count == BATCH_SIZE)
+		publishBatch(w);
+	return owner;
+}
+
+void startWorkers()
+{
+	workers = (Worker *) calloc(threads, sizeof(Worker));
+	if (!workers)
+	{
+		fprintf(stderr, "csim: out of memory\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < threads; ++i)
+	{
+		if (pthread_create(&workers[i].tid, NULL, workerRoutine, workers + i))
 		{
-			victimRow = cacherow + i;
+			fprintf(stderr, "csim: unable to create worker thread\n");
+			exit(1);
 		}
 	}
+}
 
-	/*
-	 *	capacity miss
-	 */
-	++miss;
-	++eviction;
-	victimRow->lastUsedTime = overAllTime;
-	victimRow->cacheTag = cacheTag;
+void joinWorkers()
+{
+	for (int i = 0; i < threads; ++i)
+	{
+		Worker *w = workers + i;
+		if (w->batch[w->head % QUEUE_DEPTH].count)
+			publishBatch(w);
+		__atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+	}
+
+	for (int i = 0; i < threads; ++i)
+	{
+		pthread_join(workers[i].tid, NULL);
+		hit += workers[i].hit;
+		miss += workers[i].miss;
+		eviction += workers[i].eviction;
+	}
+}
+
+void printParallelVerbose(Record *record, size_t count)
+{
+	size_t *next = (size_t *) calloc(threads, sizeof(size_t));
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Worker *w = workers + record[i].worker;
+		printVerbose(record[i].operation, record[i].address, record[i].size,
+			w->outcome[next[record[i].worker]++]);
+	}
+	free(next);
+}
+
+void stopWorkers()
+{
+	for (int i = 0; i < threads; ++i)
+		free(workers[i].outcome);
+	free(workers);
 }
 
 
 int main(int argc, char **argv)
 {
-	FILE *tracefile;
+	FILE *tracefile = NULL;
 	char opt;
-	while ((opt = getopt(argc, argv, "s:E:b:t:vh")) != EOF)
+	while ((opt = getopt(argc, argv, "s:E:b:t:p:vh")) != EOF)
 	{
 		switch (opt)
 		{
@@ -184,6 +487,10 @@ int main(int argc, char **argv)
 				tracefile = fopen(optarg, "r");
 				break;
 
+			case 'p':	//	<num>: Number of worker threads, sets are partitioned among them
+				threads = atoi(optarg);
+				break;
+
 			case 'v':	//	use the -v option for a detailed record of each hit and miss.
 				verbosity = 1;
 				break;
@@ -205,8 +512,22 @@ int main(int argc, char **argv)
 		//exit(1);
 	}
 
-	cachePool = (Block*) malloc(sizeof(Block) * E * (1 << s) );
-	memset(cachePool, 0, sizeof(Block) * E * (1 << s) );
+	if (threads > (1 << s))
+		threads = 1 << s;	//	a worker without a set has nothing to do.
+	if (threads < 1)
+		threads = 1;
+
+	wayStride = (E + WAY_VECTOR - 1) / WAY_VECTOR * WAY_VECTOR;
+	if (posix_memalign((void **)&cacheTags, 32, sizeof(*cacheTags) * wayStride * (1 << s))
+		|| posix_memalign((void **)&lastUsedTime, 32, sizeof(*lastUsedTime) * wayStride * (1 << s))
+		|| !(setFill = (unsigned *) calloc(1 << s, sizeof(*setFill))))
+	{
+		printf("%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+
+	if (threads > 1)
+		startWorkers();
 
 	/*
 	 *	Each line denotes one or two memory accesses. The format of each line is
@@ -216,33 +537,62 @@ int main(int argc, char **argv)
 		char operation;
 		unsigned long long address;
 		unsigned size;
-		while (fscanf(tracefile, "%s%llx,%u\n", &operation, &address, &size) == 3)
+		Record *record = NULL;
+		size_t recordCount = 0, recordCapacity = 0;
+
+		while (fscanf(tracefile, " %c %llx,%u", &operation, &address, &size) == 3)
 		{
 			++overAllTime;
-			switch (operation) {
-				
-				case 'M':	//	a data modify
-					visitCache(address);
-					++hit;	//	must hit in the second visitation.
-					break;
-
-				case 'L':	//	a data load
-					visitCache(address);
-					break;
-
-				case 'S':	//	a data store
-					visitCache(address);
-					break;
-
-				case 'I':	//	an instruction load
-					break;
+			if (operation != 'M' && operation != 'L' && operation != 'S')
+				continue;	//	an instruction load
+
+			if (operation == 'M')
+				++hit;	//	must hit in the second visitation.
+
+			if (threads == 1)
+			{
+				int result = visitCache(address);
+				if (verbosity)
+					printVerbose(operation, address, size, result);
+				continue;
+			}
+
+			int owner = pushAccess(address);
+			if (verbosity)
+			{
+				if (recordCount == recordCapacity)
+				{
+					recordCapacity = recordCapacity ? recordCapacity * 2 : BATCH_SIZE;
+					record = (Record *) realloc(record, sizeof(Record) * recordCapacity);
+					if (!record)
+					{
+						fprintf(stderr, "%s: out of memory\n", argv[0]);
+						exit(1);
+					}
+				}
+				record[recordCount].operation = operation;
+				record[recordCount].address = address;
+				record[recordCount].size = size;
+				record[recordCount].worker = owner;
+				++recordCount;
 			}
 		}
+
+		if (threads > 1)
+		{
+			joinWorkers();
+			if (verbosity)
+				printParallelVerbose(record, recordCount);
+			stopWorkers();
+		}
+		free(record);
 	}
 
 	fclose(tracefile);
 	
-	free(cachePool);
+	free(cacheTags);
+	free(lastUsedTime);
+	free(setFill);
     
     printSummary(hit, miss, eviction);
     
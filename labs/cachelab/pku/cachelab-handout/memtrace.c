@@ -0,0 +1,153 @@
+/*
+ * memtrace.c - Record the data accesses of the instrumented build of
+ *     trans.c and replay them on an in-process cache simulator, so that
+ *     test-trans can evaluate a transpose function without running it
+ *     under valgrind and csim-ref.
+ *
+ * trans-inst.o is trans.c compiled with -fsanitize=kernel-address and
+ * asan-instrumentation-with-call-threshold=0 (see the Makefile). gcc then
+ * calls __asan_{load,store}N_noabort(addr) before every load and store
+ * that may touch memory, and expects the environment to provide those
+ * hooks, which is what this file does.
+ *
+ * The simulator follows csim-ref: LRU replacement, the access size is
+ * ignored, and a modify shows up as a load followed by a store to the
+ * same address, i.e. a visit followed by a hit. Like the valgrind path,
+ * which only keeps addresses below 4GB, accesses to the stack are
+ * ignored.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "memtrace.h"
+
+/* Geometry and state of the simulated cache */
+static unsigned int set_bits, lines, block_bits;
+static unsigned long long *tags;    /* lines per set */
+static unsigned long long *stamps;  /* LRU stamp, 0 if the line is invalid */
+static unsigned long long now;
+
+static unsigned int hits, misses, evictions;
+
+/* Set while the registered function under evaluation is running */
+static int tracing;
+
+/* Extent of the stack of the calling thread */
+static unsigned long stack_lo, stack_hi;
+
+/*
+ * traceInit - Reset the simulated cache to an empty one with 2^s sets
+ *     of E lines of 2^b bytes
+ */
+void traceInit(unsigned int s, unsigned int E, unsigned int b)
+{
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    traceFree();
+    set_bits = s;
+    lines = E;
+    block_bits = b;
+    tags = calloc((size_t)E << s, sizeof(*tags));
+    stamps = calloc((size_t)E << s, sizeof(*stamps));
+    if (tags == NULL || stamps == NULL) {
+        fprintf(stderr, "traceInit: out of memory\n");
+        exit(1);
+    }
+    now = 0;
+    hits = misses = evictions = 0;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstack(&attr, &addr, &size);
+        stack_lo = (unsigned long)addr;
+        stack_hi = stack_lo + size;
+        pthread_attr_destroy(&attr);
+    }
+}
+
+void traceBegin(void)
+{
+    tracing = 1;
+}
+
+void traceEnd(void)
+{
+    tracing = 0;
+}
+
+void traceResults(unsigned int *h, unsigned int *m, unsigned int *e)
+{
+    *h = hits;
+    *m = misses;
+    *e = evictions;
+}
+
+void traceFree(void)
+{
+    free(tags);
+    free(stamps);
+    tags = stamps = NULL;
+}
+
+/*
+ * visit - Simulate one access
+ */
+static void visit(unsigned long addr)
+{
+    unsigned long long tag = addr >> block_bits >> set_bits;
+    size_t set = (addr >> block_bits) & ((1UL << set_bits) - 1);
+    unsigned long long *set_tags = tags + set * lines;
+    unsigned long long *set_stamps = stamps + set * lines;
+    unsigned int i, victim = 0;
+
+    ++now;
+    for (i = 0; i < lines; i++) {
+        if (set_stamps[i] == 0) {       /* compulsory miss */
+            misses++;
+            set_tags[i] = tag;
+            set_stamps[i] = now;
+            return;
+        }
+        if (set_tags[i] == tag) {       /* hit */
+            hits++;
+            set_stamps[i] = now;
+            return;
+        }
+        if (set_stamps[i] < set_stamps[victim])
+            victim = i;
+    }
+
+    misses++;                           /* capacity / conflict miss */
+    evictions++;
+    set_tags[victim] = tag;
+    set_stamps[victim] = now;
+}
+
+static inline void record(unsigned long addr)
+{
+    if (!tracing)
+        return;
+    if (addr >= stack_lo && addr < stack_hi)
+        return;
+    visit(addr);
+}
+
+/*
+ * The hooks called by the instrumented code
+ */
+void __asan_load1_noabort(unsigned long addr) { record(addr); }
+void __asan_load2_noabort(unsigned long addr) { record(addr); }
+void __asan_load4_noabort(unsigned long addr) { record(addr); }
+void __asan_load8_noabort(unsigned long addr) { record(addr); }
+void __asan_load16_noabort(unsigned long addr) { record(addr); }
+void __asan_loadN_noabort(unsigned long addr, size_t size) { record(addr); }
+void __asan_store1_noabort(unsigned long addr) { record(addr); }
+void __asan_store2_noabort(unsigned long addr) { record(addr); }
+void __asan_store4_noabort(unsigned long addr) { record(addr); }
+void __asan_store8_noabort(unsigned long addr) { record(addr); }
+void __asan_store16_noabort(unsigned long addr) { record(addr); }
+void __asan_storeN_noabort(unsigned long addr, size_t size) { record(addr); }
+void __asan_handle_no_return(void) { }
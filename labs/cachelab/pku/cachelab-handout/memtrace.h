@@ -0,0 +1,23 @@
+/*
+ * memtrace.h - Prototypes for the in-process tracer and cache simulator
+ *     used to evaluate the instrumented build of trans.c
+ */
+
+#ifndef MEMTRACE_H
+#define MEMTRACE_H
+
+/* Reset the simulated cache to an empty one with the given geometry */
+void traceInit(unsigned int s, unsigned int E, unsigned int b);
+
+/* Start / stop feeding the accesses of trans.c to the simulator */
+void traceBegin(void);
+void traceEnd(void);
+
+/* Statistics of every access fed since the last traceInit() */
+void traceResults(unsigned int *hits, unsigned int *misses,
+                  unsigned int *evictions);
+
+/* Release the simulated cache */
+void traceFree(void);
+
+#endif /* MEMTRACE_H */
@@ -0,0 +1,237 @@
+/*
+ * trans-native.c - Transpose kernels tuned for real hardware rather than
+ *     for the simulated 1KB cache of Part B. They are not meant to be run
+ *     under tracegen / test-trans: the threaded kernel and the vector
+ *     loads would not map onto the simulated cache in a useful way.
+ *
+ * Each kernel has the usual prototype
+ *     void trans(int M, int N, int A[N][M], int B[M][N]);
+ * and is registered by registerNativeFunctions().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include "cachelab.h"
+#include "trans-native.h"
+
+/* Side of the square tiles walked by the tiled kernels */
+#define TILE 64
+
+/* Leaves of the recursion are at most LEAF x LEAF elements */
+#define LEAF 16
+
+/* Upper bound on the worker threads of trans_threaded */
+#define MAX_THREADS 64
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+ * transpose_8x8 - Transpose one 8x8 block held in eight ymm registers
+ */
+__attribute__((target("avx2")))
+static inline void transpose_8x8(const int *src, int src_stride,
+                                 int *dst, int dst_stride)
+{
+    __m256 r0, r1, r2, r3, r4, r5, r6, r7;
+    __m256 t0, t1, t2, t3, t4, t5, t6, t7;
+
+#define LOAD(k) _mm256_castsi256_ps( \
+        _mm256_loadu_si256((const __m256i *)(src + (k) * src_stride)))
+    r0 = LOAD(0); r1 = LOAD(1); r2 = LOAD(2); r3 = LOAD(3);
+    r4 = LOAD(4); r5 = LOAD(5); r6 = LOAD(6); r7 = LOAD(7);
+#undef LOAD
+
+    /* interleave pairs of rows */
+    t0 = _mm256_unpacklo_ps(r0, r1); t1 = _mm256_unpackhi_ps(r0, r1);
+    t2 = _mm256_unpacklo_ps(r2, r3); t3 = _mm256_unpackhi_ps(r2, r3);
+    t4 = _mm256_unpacklo_ps(r4, r5); t5 = _mm256_unpackhi_ps(r4, r5);
+    t6 = _mm256_unpacklo_ps(r6, r7); t7 = _mm256_unpackhi_ps(r6, r7);
+
+    /* gather 4-element columns inside each 128-bit lane */
+    r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    /* swap the 128-bit lanes across the two halves */
+    t0 = _mm256_permute2f128_ps(r0, r4, 0x20);
+    t1 = _mm256_permute2f128_ps(r1, r5, 0x20);
+    t2 = _mm256_permute2f128_ps(r2, r6, 0x20);
+    t3 = _mm256_permute2f128_ps(r3, r7, 0x20);
+    t4 = _mm256_permute2f128_ps(r0, r4, 0x31);
+    t5 = _mm256_permute2f128_ps(r1, r5, 0x31);
+    t6 = _mm256_permute2f128_ps(r2, r6, 0x31);
+    t7 = _mm256_permute2f128_ps(r3, r7, 0x31);
+
+#define STORE(k, v) _mm256_storeu_si256((__m256i *)(dst + (k) * dst_stride), \
+        _mm256_castps_si256(v))
+    STORE(0, t0); STORE(1, t1); STORE(2, t2); STORE(3, t3);
+    STORE(4, t4); STORE(5, t5); STORE(6, t6); STORE(7, t7);
+#undef STORE
+}
+
+/*
+ * trans_tile_avx2 - Transpose rows [i0, i1) x columns [j0, j1) of A,
+ *     8x8 blocks in registers and the ragged edges one by one
+ */
+__attribute__((target("avx2")))
+static void trans_tile_avx2(int M, int N, int A[N][M], int B[M][N],
+                            int i0, int i1, int j0, int j1)
+{
+    int i, j;
+    int i8 = i0 + (i1 - i0) / 8 * 8;
+    int j8 = j0 + (j1 - j0) / 8 * 8;
+
+    for (i = i0; i < i8; i += 8)
+        for (j = j0; j < j8; j += 8)
+            transpose_8x8(&A[i][j], M, &B[j][i], N);
+
+    for (i = i0; i < i1; i++)
+        for (j = (i < i8 ? j8 : j0); j < j1; j++)
+            B[j][i] = A[i][j];
+}
+
+/*
+ * trans_avx2 - AVX2 8x8 in-register transposes over TILE x TILE tiles
+ */
+char trans_avx2_desc[] = "AVX2 8x8 in-register transpose";
+__attribute__((target("avx2")))
+void trans_avx2(int M, int N, int A[N][M], int B[M][N])
+{
+    int i, j;
+
+    for (i = 0; i < N; i += TILE)
+        for (j = 0; j < M; j += TILE)
+            trans_tile_avx2(M, N, A, B, i, MIN(i + TILE, N), j, MIN(j + TILE, M));
+}
+
+/*
+ * trans_rec - Halve the longer side of [i0, i1) x [j0, j1) until the
+ *     piece fits in a LEAF x LEAF block, which is copied directly
+ */
+static void trans_rec(int M, int N, int A[N][M], int B[M][N],
+                      int i0, int i1, int j0, int j1)
+{
+    int i, j;
+
+    if (i1 - i0 <= LEAF && j1 - j0 <= LEAF) {
+        for (i = i0; i < i1; i++)
+            for (j = j0; j < j1; j++)
+                B[j][i] = A[i][j];
+        return;
+    }
+
+    if (i1 - i0 >= j1 - j0) {
+        int mid = i0 + (i1 - i0) / 2;
+        trans_rec(M, N, A, B, i0, mid, j0, j1);
+        trans_rec(M, N, A, B, mid, i1, j0, j1);
+    } else {
+        int mid = j0 + (j1 - j0) / 2;
+        trans_rec(M, N, A, B, i0, i1, j0, mid);
+        trans_rec(M, N, A, B, i0, i1, mid, j1);
+    }
+}
+
+/*
+ * trans_recursive - Cache-oblivious transpose: no tile size to tune,
+ *     every level of the memory hierarchy sees blocks that fit it
+ */
+char trans_recursive_desc[] = "Recursive cache-oblivious transpose";
+void trans_recursive(int M, int N, int A[N][M], int B[M][N])
+{
+    trans_rec(M, N, A, B, 0, N, 0, M);
+}
+
+/* The band of rows of A handed to one thread */
+typedef struct {
+    int M, N;
+    int *A, *B;
+    int row_begin, row_end;
+    int use_avx2;
+} band_t;
+
+static void *trans_band(void *vargp)
+{
+    band_t *band = vargp;
+    int M = band->M, N = band->N;
+    int (*A)[M] = (int (*)[M])band->A;
+    int (*B)[N] = (int (*)[N])band->B;
+    int i, j, ii, jj;
+
+    for (i = band->row_begin; i < band->row_end; i += TILE) {
+        int i1 = MIN(i + TILE, band->row_end);
+        for (j = 0; j < M; j += TILE) {
+            int j1 = MIN(j + TILE, M);
+            if (band->use_avx2) {
+                trans_tile_avx2(M, N, A, B, i, i1, j, j1);
+                continue;
+            }
+            for (ii = i; ii < i1; ii++)
+                for (jj = j; jj < j1; jj++)
+                    B[jj][ii] = A[ii][jj];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * trans_threaded - Split the rows of A into one band per CPU, and
+ *     transpose each band tile by tile on its own thread
+ */
+char trans_threaded_desc[] = "Multi-threaded tiled transpose";
+void trans_threaded(int M, int N, int A[N][M], int B[M][N])
+{
+    pthread_t tid[MAX_THREADS];
+    band_t band[MAX_THREADS];
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int rows_per_thread, t, started;
+
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    if (nthreads > (N + TILE - 1) / TILE)
+        nthreads = (N + TILE - 1) / TILE;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    /* keep the bands TILE-aligned so no tile is split between threads */
+    rows_per_thread = ((N + nthreads - 1) / nthreads + TILE - 1) / TILE * TILE;
+
+    for (t = 0; t < nthreads; t++) {
+        band[t].M = M;
+        band[t].N = N;
+        band[t].A = &A[0][0];
+        band[t].B = &B[0][0];
+        band[t].row_begin = MIN(t * rows_per_thread, N);
+        band[t].row_end = MIN((t + 1) * rows_per_thread, N);
+        band[t].use_avx2 = __builtin_cpu_supports("avx2");
+    }
+
+    /* the calling thread takes the first band itself */
+    for (started = 1; started < nthreads; started++)
+        if (pthread_create(&tid[started], NULL, trans_band, &band[started]) != 0)
+            break;
+    trans_band(&band[0]);
+    for (t = started; t < nthreads; t++)
+        trans_band(&band[t]);   /* thread creation failed, do it here */
+    for (t = 1; t < started; t++)
+        pthread_join(tid[t], NULL);
+}
+
+/*
+ * registerNativeFunctions - Register the kernels the CPU supports
+ */
+void registerNativeFunctions(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        registerTransFunction(trans_avx2, trans_avx2_desc);
+    registerTransFunction(trans_recursive, trans_recursive_desc);
+    registerTransFunction(trans_threaded, trans_threaded_desc);
+}
@@ -0,0 +1,21 @@
+/*
+ * trans-native.h - Transpose kernels tuned for real hardware rather than
+ *     for the simulated cache, benchmarked by bench-trans
+ */
+
+#ifndef TRANS_NATIVE_H
+#define TRANS_NATIVE_H
+
+/* AVX2 8x8 in-register transposes over 64x64 tiles */
+void trans_avx2(int M, int N, int A[N][M], int B[M][N]);
+
+/* Recursive, cache-oblivious transpose */
+void trans_recursive(int M, int N, int A[N][M], int B[M][N]);
+
+/* Tiled transpose, rows of A split across one thread per CPU */
+void trans_threaded(int M, int N, int A[N][M], int B[M][N]);
+
+/* Register the kernels the CPU supports with the driver */
+void registerNativeFunctions(void);
+
+#endif /* TRANS_NATIVE_H */
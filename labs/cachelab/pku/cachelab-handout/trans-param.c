@@ -0,0 +1,85 @@
+/*
+ * trans-param.c - A transpose kernel whose blocking and schedule are
+ *     set at run time, used by tune-trans to search for the schedule
+ *     with the fewest misses on a given matrix and cache shape.
+ *
+ * Like trans.c, this file is built with the memtrace instrumentation,
+ * so every load and store of the matrices reaches the simulator.
+ */
+#include <stdio.h>
+#include "trans-param.h"
+
+trans_params_t trans_params = { 8, 8, 0, 1, 0 };
+
+/*
+ * load_params - Read the schedule without it showing up in the trace
+ */
+__attribute__((no_sanitize_address))
+static trans_params_t load_params(void)
+{
+    return trans_params;
+}
+
+/*
+ * trans_block - Transpose the block of A with its top-left corner at
+ *     A[bi][bj]: each row in groups of depth elements, then the ones
+ *     left over one at a time (the code tune-trans emits does the same)
+ */
+static void trans_block(int M, int N, int A[N][M], int B[M][N],
+                        int bi, int bj, trans_params_t p)
+{
+    int i, j, k, diag = 0, has_diag;
+    int buf[TRANS_MAX_DEPTH];
+    int row_end = bi + p.block_rows < N ? bi + p.block_rows : N;
+    int col_end = bj + p.block_cols < M ? bj + p.block_cols : M;
+
+    for (i = bi; i < row_end; i++) {
+        has_diag = 0;
+        j = bj;
+        if (p.depth > 1) {
+            for (; j + p.depth <= col_end; j += p.depth) {
+                for (k = 0; k < p.depth; k++)
+                    buf[k] = A[i][j + k];
+                for (k = 0; k < p.depth; k++)
+                    B[j + k][i] = buf[k];
+            }
+        }
+        for (; j < col_end; j++) {
+            if (p.defer_diagonal && i == j) {
+                diag = A[i][j]; /* B[i][i] would evict A's row */
+                has_diag = 1;
+            } else {
+                B[j][i] = A[i][j];
+            }
+        }
+        if (has_diag)
+            B[i][i] = diag;
+    }
+}
+
+/*
+ * trans_param - B = A^T, blocked and scheduled as trans_params says
+ */
+void trans_param(int M, int N, int A[N][M], int B[M][N])
+{
+    trans_params_t p = load_params();
+    int bi, bj;
+
+    if (p.col_major) {
+        for (bj = 0; bj < M; bj += p.block_cols)
+            for (bi = 0; bi < N; bi += p.block_rows)
+                trans_block(M, N, A, B, bi, bj, p);
+    } else {
+        for (bi = 0; bi < N; bi += p.block_rows)
+            for (bj = 0; bj < M; bj += p.block_cols)
+                trans_block(M, N, A, B, bi, bj, p);
+    }
+}
+
+void describe_params(const trans_params_t *p, char *buf, int len)
+{
+    snprintf(buf, len, "%dx%d blocks, %s, depth %d%s",
+             p->block_rows, p->block_cols,
+             p->col_major ? "column-major" : "row-major",
+             p->depth, p->defer_diagonal ? ", deferred diagonal" : "");
+}
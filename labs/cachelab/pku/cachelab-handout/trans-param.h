@@ -0,0 +1,30 @@
+/*
+ * trans-param.h - A transpose kernel whose blocking and schedule are
+ *     set at run time, used by tune-trans
+ */
+
+#ifndef TRANS_PARAM_H
+#define TRANS_PARAM_H
+
+/* Largest number of elements buffered in locals at once */
+#define TRANS_MAX_DEPTH 8
+
+typedef struct {
+    int block_rows;     /* rows of A in a block */
+    int block_cols;     /* columns of A in a block */
+    int defer_diagonal; /* store B[i][i] after the rest of row i (depth 1) */
+    int depth;          /* elements of a row of A read into locals before
+                           being stored to B */
+    int col_major;      /* visit the blocks column by column */
+} trans_params_t;
+
+/* The schedule used by trans_param() */
+extern trans_params_t trans_params;
+
+/* B = A^T, following trans_params */
+void trans_param(int M, int N, int A[N][M], int B[M][N]);
+
+/* Describe the schedule in a registerTransFunction() description */
+void describe_params(const trans_params_t *p, char *buf, int len);
+
+#endif /* TRANS_PARAM_H */
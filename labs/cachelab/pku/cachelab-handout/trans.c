@@ -226,6 +226,7 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
 	}
 	else
 	{
+		r7 = 8; // any other shape, e.g. from bench-trans
 		if (M == 32 && N == 32) r7 = 8;
 		if (M == 61 && N == 67) r7 = 17;
 		/*
@@ -262,7 +263,7 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
 						{
 							if (k >= M)
 								break;
-								B[k][l] = A[l][k];
+							B[k][l] = A[l][k];
 						}
 
 						r1 = A[l][l]; // save A(l,l) to avoid evictions
@@ -272,7 +273,7 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
 							if (k >= M)
 								break;
 
-								B[k][l] = A[l][k];
+							B[k][l] = A[l][k];
 						}
 						
 						B[l][l] = r1;
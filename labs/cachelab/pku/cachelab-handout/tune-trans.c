@@ -0,0 +1,275 @@
+/*
+ * tune-trans.c - Search the schedules of trans_param() for the one with
+ *     the fewest misses on an M x N matrix and a given cache shape.
+ *
+ * Each variant (block size, traversal order, buffering depth, diagonal
+ * handling) is registered through registerTransFunction(), run once on
+ * the instrumented kernel, validated, and scored by the in-process
+ * simulator in memtrace.c. The best variant is printed as a complete
+ * transpose function, with its schedule unrolled into plain loops and
+ * at most 12 int locals, to paste into trans.c and register (or to call
+ * from transpose_submit for that M and N).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include "cachelab.h"
+#include "memtrace.h"
+#include "trans-param.h"
+
+/* Maximum array dimension */
+#define MAXN 256
+
+/* Longest variant description */
+#define DESCLEN 64
+
+/* External variables defined in cachelab.c */
+extern trans_func_t func_list[MAX_TRANS_FUNCS];
+extern int func_counter;
+
+/* One point of the search space */
+typedef struct {
+    trans_params_t params;
+    char desc[DESCLEN];
+    int correct;
+    unsigned int misses;
+} variant_t;
+
+/* Candidate values of each parameter */
+static const int block_sizes[] = { 2, 4, 8, 12, 16, 17, 23, 32 };
+static const int depths[] = { 1, 2, 4, 8 };
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static int A[MAXN][MAXN];
+static int B[MAXN][MAXN];
+static int M = 0;
+static int N = 0;
+
+/*
+ * enumerate - Fill v with every variant worth trying, return how many
+ */
+static int enumerate(variant_t *v)
+{
+    int r, c, d, diag, order, n = 0;
+
+    for (r = 0; r < COUNT(block_sizes); r++)
+    for (c = 0; c < COUNT(block_sizes); c++)
+    for (d = 0; d < COUNT(depths); d++)
+    for (diag = 0; diag <= (depths[d] == 1); diag++)
+    for (order = 0; order < 2; order++) {
+        if (block_sizes[r] > N || block_sizes[c] > M ||
+            depths[d] > block_sizes[c])
+            continue;
+        v[n].params.block_rows = block_sizes[r];
+        v[n].params.block_cols = block_sizes[c];
+        v[n].params.depth = depths[d];
+        v[n].params.defer_diagonal = diag;
+        v[n].params.col_major = order;
+        describe_params(&v[n].params, v[n].desc, DESCLEN);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * is_transposed - Check B against A
+ */
+static int is_transposed(int M, int N, int A[N][M], int B[M][N])
+{
+    int i, j;
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < M; j++)
+            if (A[i][j] != B[j][i])
+                return 0;
+    return 1;
+}
+
+/*
+ * evaluate - Register the variants MAX_TRANS_FUNCS at a time and count
+ *     the misses of each one
+ */
+static void evaluate(variant_t *v, int n, unsigned int s, unsigned int E,
+                     unsigned int b)
+{
+    int first, i;
+    unsigned int hits, misses, evictions;
+
+    for (first = 0; first < n; first += MAX_TRANS_FUNCS) {
+        func_counter = 0;
+        for (i = first; i < n && i < first + MAX_TRANS_FUNCS; i++)
+            registerTransFunction(trans_param, v[i].desc);
+
+        for (i = 0; i < func_counter; i++) {
+            variant_t *cur = &v[first + i];
+
+            trans_params = cur->params;
+            initMatrix(M, N, A, B);
+            traceInit(s, E, b);
+            traceBegin();
+            (*func_list[i].func_ptr)(M, N, A, B);
+            traceEnd();
+            traceResults(&hits, &misses, &evictions);
+
+            func_list[i].correct = is_transposed(M, N, A, B);
+            func_list[i].num_hits = hits;
+            func_list[i].num_misses = misses;
+            func_list[i].num_evictions = evictions;
+
+            cur->correct = func_list[i].correct;
+            cur->misses = cur->correct ? misses : UINT_MAX;
+        }
+    }
+    traceFree();
+}
+
+/*
+ * emit_kernel - Print the transpose function of a variant
+ */
+static void emit_kernel(const variant_t *v, unsigned int s, unsigned int E,
+                        unsigned int b)
+{
+    const trans_params_t *p = &v->params;
+    char name[32];
+    int k;
+
+    snprintf(name, sizeof(name), "trans_tuned_%dx%d", M, N);
+    printf("/* tune-trans -M %d -N %d -s %u -E %u -b %u: %u misses */\n",
+           M, N, s, E, b, v->misses);
+    printf("char %s_desc[] = \"Tuned: %s\";\n", name, v->desc);
+    printf("void %s(int M, int N, int A[N][M], int B[M][N])\n{\n", name);
+    printf("    int bi, bj, i, j");
+    if (p->depth > 1 || p->defer_diagonal)
+        for (k = 0; k < p->depth; k++)
+            printf(", t%d", k);
+    printf(";\n\n");
+
+    if (p->col_major) {
+        printf("    for (bj = 0; bj < M; bj += %d)\n", p->block_cols);
+        printf("        for (bi = 0; bi < N; bi += %d)\n", p->block_rows);
+    } else {
+        printf("    for (bi = 0; bi < N; bi += %d)\n", p->block_rows);
+        printf("        for (bj = 0; bj < M; bj += %d)\n", p->block_cols);
+    }
+    printf("            for (i = bi; i < bi + %d && i < N; i++) {\n",
+           p->block_rows);
+    printf("                j = bj;\n");
+    if (p->depth > 1) {
+        printf("                for (; j + %d <= bj + %d && j + %d <= M; "
+               "j += %d) {\n", p->depth, p->block_cols, p->depth, p->depth);
+        printf("                    t0 = A[i][j];\n");
+        for (k = 1; k < p->depth; k++)
+            printf("                    t%d = A[i][j + %d];\n", k, k);
+        printf("                    B[j][i] = t0;\n");
+        for (k = 1; k < p->depth; k++)
+            printf("                    B[j + %d][i] = t%d;\n", k, k);
+        printf("                }\n");
+    }
+    printf("                for (; j < bj + %d && j < M; j++)\n",
+           p->block_cols);
+    if (p->defer_diagonal) {
+        printf("                    if (i != j)\n");
+        printf("                        B[j][i] = A[i][j];\n");
+        printf("                    else\n");
+        printf("                        t0 = A[i][j];\n");
+        printf("                if (i >= bj && i < bj + %d && i < M)\n",
+               p->block_cols);
+        printf("                    B[i][i] = t0;\n");
+    } else {
+        printf("                    B[j][i] = A[i][j];\n");
+    }
+    printf("            }\n}\n");
+}
+
+static int by_misses(const void *x, const void *y)
+{
+    const variant_t *a = x, *b = y;
+    return (a->misses > b->misses) - (a->misses < b->misses);
+}
+
+/*
+ * usage - Print usage info
+ */
+static void usage(char *argv[])
+{
+    printf("Usage: %s [-h] -M <rows> -N <cols> [-s <s>] [-E <E>] [-b <b>] [-n <num>]\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -M <rows>   Number of matrix rows (max %d)\n", MAXN);
+    printf("  -N <cols>   Number of matrix columns (max %d)\n", MAXN);
+    printf("  -s <s>      Number of set index bits (default 5)\n");
+    printf("  -E <E>      Number of lines per set (default 1)\n");
+    printf("  -b <b>      Number of block offset bits (default 5)\n");
+    printf("  -n <num>    Number of variants to list (default 10)\n");
+    printf("Example: %s -M 32 -N 32\n", argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    char c;
+    int i, n, top = 10;
+    unsigned int s = 5, E = 1, b = 5;
+    variant_t *v;
+
+    while ((c = getopt(argc, argv, "M:N:s:E:b:n:h")) != -1) {
+        switch (c) {
+        case 'M':
+            M = atoi(optarg);
+            break;
+        case 'N':
+            N = atoi(optarg);
+            break;
+        case 's':
+            s = atoi(optarg);
+            break;
+        case 'E':
+            E = atoi(optarg);
+            break;
+        case 'b':
+            b = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+
+    if (M <= 0 || N <= 0 || M > MAXN || N > MAXN) {
+        printf("Error: M and N must be between 1 and %d\n", MAXN);
+        usage(argv);
+        exit(1);
+    }
+
+    v = calloc(COUNT(block_sizes) * COUNT(block_sizes) * (COUNT(depths) + 1) * 2,
+               sizeof(*v));
+    if (v == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    n = enumerate(v);
+    evaluate(v, n, s, E, b);
+    qsort(v, n, sizeof(*v), by_misses);
+
+    printf("%d variants for M=%d N=%d on s=%u E=%u b=%u\n", n, M, N, s, E, b);
+    printf("%6s  %s\n", "misses", "variant");
+    for (i = 0; i < n && i < top && v[i].correct; i++)
+        printf("%6u  %s\n", v[i].misses, v[i].desc);
+
+    if (v[0].correct) {
+        printf("\n");
+        emit_kernel(&v[0], s, E, b);
+    }
+
+    free(v);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# bench-libmm.sh - Run real programs on glibc malloc and on mm.c
+#     (LD_PRELOAD=./libmm.so), and compare wall time and peak RSS.
+#
+#     cc1     gcc -O2 compiling mdriver.c
+#     sort    sort over a shuffled file of lines
+#     proxy   the proxy lab proxy serving tiny's pages to curl,
+#             needs "make" in ../../proxylab/proxylab-handout and its tiny/
+#
+#     The fragmentation column is 1 - live peak / (heap peak + mapped peak)
+#     from LIBMM_STATS, of the largest process of the workload.
+#
+# Usage: ./bench-libmm.sh [lines] [requests]
+#
+
+LINES=${1:-1000000}
+REQUESTS=${2:-500}
+LIBMM=$PWD/libmm.so
+PROXYLAB=${PROXYLAB:-../../proxylab/proxylab-handout}
+INPUT=sort.bench
+
+make -s libmm.so || exit 1
+seq $LINES | awk 'BEGIN { srand(15213) } { printf("%08x %s\n", rand() * 2^32, $0) }' > $INPUT
+
+# run "$@" and print "<seconds> <peak RSS of the largest process in KB>"
+measure() {
+    python3 - "$@" <<'EOF'
+import resource, subprocess, sys, time
+start = time.time()
+subprocess.run(sys.argv[1:], stdout=subprocess.DEVNULL,
+               stderr=subprocess.DEVNULL)
+rss = resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss
+print("%.3f %d" % (time.time() - start, rss))
+EOF
+}
+
+# only the proxy runs on the LD_PRELOAD it was given, not tiny or curl
+proxy_workload() {
+    local preload=$LD_PRELOAD
+    unset LD_PRELOAD
+    local tiny_port=$((15000 + RANDOM % 20000))
+    local proxy_port=$((tiny_port + 1))
+    (cd $PROXYLAB/tiny && exec ./tiny $tiny_port > /dev/null 2>&1) &
+    local tiny=$!
+    env ${preload:+LD_PRELOAD=$preload} $PROXYLAB/proxy $proxy_port > /dev/null &
+    local proxy=$!
+    sleep 1
+    for ((i = 0; i < REQUESTS; i++)); do
+        curl -s --max-time 5 --proxy http://localhost:$proxy_port \
+            http://localhost:$tiny_port/home.html > /dev/null
+    done
+    kill $proxy; wait $proxy 2> /dev/null
+    kill $tiny; wait $tiny 2> /dev/null
+}
+
+run() {
+    local name=$1; shift
+    local glibc=($(measure "$@"))
+    local mm=($(measure env LD_PRELOAD=$LIBMM "$@"))
+    local frag=$(env LIBMM_STATS=1 LD_PRELOAD=$LIBMM "$@" 2>&1 >/dev/null |
+        awk '/^libmm:/ && $4 + 0 >= best { best = $4; f = $15 }
+            END { print f ? f : "-" }')
+    printf "%-6s %9.3f %9.3f %10d %10d %7s\n" $name \
+        ${glibc[0]} ${mm[0]} ${glibc[1]} ${mm[1]} $frag
+}
+
+printf "%-6s %9s %9s %10s %10s %7s\n" "" "glibc(s)" "libmm(s)" \
+    "glibc(KB)" "libmm(KB)" "frag"
+run cc1 gcc -O2 -DDRIVER -c -o /dev/null mdriver.c
+run sort sort $INPUT
+if [ -x $PROXYLAB/proxy ] && [ -x $PROXYLAB/tiny/tiny ] && command -v curl > /dev/null; then
+    export -f proxy_workload
+    export PROXYLAB REQUESTS
+    run proxy bash -c proxy_workload
+else
+    echo "proxy  skipped (make $PROXYLAB and its tiny/, and install curl)"
+fi
+
+rm -f $INPUT
@@ -106,7 +106,9 @@
 /*
  * Maximum heap size in bytes
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
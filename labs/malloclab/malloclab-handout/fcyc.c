@@ -6,10 +6,24 @@
  *
  * Uses the cycle timer routines in clock.c to estimate the
  * the time in CPU cycles for a function f.
+ *
+ * On Linux, hardware counters (perf_event_open) may also be read around
+ * each sample; the counts kept are those of the best sample.
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #include "fcyc.h"
 #include "clock.h"
@@ -33,6 +47,12 @@ static int cache_block = CACHE_BLOCK;
 
 static int *cache_buf = NULL;
 
+static int warmup = 0;       /* untimed runs before the samples */
+static int counters = 0;     /* number of hardware events counted */
+static int counter_fd[FCYC_EVENTS];  /* -1 if the event isn't counted */
+static double sample_counts[FCYC_EVENTS];
+static double best_counts[FCYC_EVENTS];
+
 static double *values = NULL;
 static int samplecount = 0;
 
@@ -62,11 +82,11 @@ static void init_sampler()
 }
 
 /* 
- * add_sample - Add new sample  
+ * add_sample - Add new sample, return its rank among the K best
  */
-static void add_sample(double val)
+static int add_sample(double val)
 {
-    int pos = 0;
+    int pos = kbest;
     if (samplecount < kbest) {
 	pos = samplecount;
 	values[pos] = val;
@@ -79,12 +99,13 @@ static void add_sample(double val)
 #endif
     samplecount++;
     /* Insertion sort */
-    while (pos > 0 && values[pos-1] > values[pos]) {
+    while (pos > 0 && pos < kbest && values[pos-1] > values[pos]) {
 	double temp = values[pos-1];
 	values[pos-1] = values[pos];
 	values[pos] = temp;
 	pos--;
     }
+    return pos;
 }
 
 /* 
@@ -123,34 +144,92 @@ static void clear()
     sink = x;
 }
 
+#ifdef __linux__
+/* What a read of the group returns with PERF_FORMAT_GROUP */
+struct counter_group {
+    unsigned long long nr;
+    unsigned long long time_enabled;
+    unsigned long long time_running;
+    unsigned long long values[FCYC_EVENTS];
+};
+
+/*
+ * start_events - Zero and start the group of hardware counters
+ */
+static void start_events()
+{
+    ioctl(counter_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counter_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/*
+ * stop_events - Stop the group and read it into sample_counts,
+ *     scaled up if the kernel had to multiplex the counters
+ */
+static void stop_events()
+{
+    struct counter_group group;
+    int i, n = 0;
+    double scale;
+
+    ioctl(counter_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(counter_fd[0], &group, sizeof(group)) < 0 ||
+	group.time_running == 0) {
+	for (i = 0; i < FCYC_EVENTS; i++)
+	    sample_counts[i] = -1;
+	return;
+    }
+
+    scale = (double)group.time_enabled / group.time_running;
+    for (i = 0; i < FCYC_EVENTS; i++)
+	sample_counts[i] = counter_fd[i] < 0 ? -1 : group.values[n++] * scale;
+}
+#else
+static void start_events() {}
+static void stop_events() {}
+#endif
+
+/*
+ * sample - Time one run of f, count its events if counters are on
+ */
+static double sample(test_funct f, void *argp)
+{
+    double cyc;
+
+    if (clear_cache)
+	clear();
+    if (counters)
+	start_events();
+    if (compensate) {
+	start_comp_counter();
+	f(argp);
+	cyc = get_comp_counter();
+    } else {
+	start_counter();
+	f(argp);
+	cyc = get_counter();
+    }
+    if (counters)
+	stop_events();
+    return cyc;
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
 double fcyc(test_funct f, void *argp)
 {
     double result;
+    int i;
+
+    for (i = 0; i < warmup; i++)
+	f(argp);
+
     init_sampler();
-    if (compensate) {
-	do {
-	    double cyc;
-	    if (clear_cache)
-		clear();
-	    start_comp_counter();
-	    f(argp);
-	    cyc = get_comp_counter();
-	    add_sample(cyc);
-	} while (!has_converged() && samplecount < maxsamples);
-    } else {
-	do {
-	    double cyc;
-	    if (clear_cache)
-		clear();
-	    start_counter();
-	    f(argp);
-	    cyc = get_counter();
-	    add_sample(cyc);
-	} while (!has_converged() && samplecount < maxsamples);
-    }
+    do {
+	if (add_sample(sample(f, argp)) == 0 && counters)
+	    memcpy(best_counts, sample_counts, sizeof(best_counts));
+    } while (!has_converged() && samplecount < maxsamples);
 #ifdef DEBUG
     {
 	int i;
@@ -245,7 +324,124 @@ void set_fcyc_epsilon(double epsilon_arg)
     epsilon = epsilon_arg;
 }
 
+/* 
+ * set_fcyc_warmup - Number of untimed runs of f before the samples
+ *     Default = 0
+ */
+void set_fcyc_warmup(int runs)
+{
+    warmup = runs;
+}
+
 
+/*************************************************************
+ * Hardware performance counters
+ ************************************************************/
+
+#ifdef __linux__
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[FCYC_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/*
+ * open_event - Open event i in the group of leader (-1 to lead it),
+ *     in user space only if the kernel won't let us count its side.
+ */
+static int open_event(int i, int leader)
+{
+    struct perf_event_attr attr;
+    int fd;
 
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = leader < 0;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP |
+	PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
 
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+	attr.exclude_kernel = 1;
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+    }
+    return fd;
+}
+#endif
 
+/* 
+ * set_fcyc_counters - When set, will count hardware events around
+ *     each sample.  Returns the number of events counted.
+ *     Default = 0
+ */
+int set_fcyc_counters(int counters_arg)
+{
+    int i;
+
+    if (counters)
+	for (i = 0; i < FCYC_EVENTS; i++)
+	    if (counter_fd[i] >= 0)
+		close(counter_fd[i]);
+    counters = 0;
+    if (!counters_arg)
+	return 0;
+
+#ifdef __linux__
+    /* The cycles lead the group, so every event is read at once */
+    if ((counter_fd[0] = open_event(0, -1)) < 0)
+	return 0;
+    counters = 1;
+    for (i = 1; i < FCYC_EVENTS; i++)
+	if ((counter_fd[i] = open_event(i, counter_fd[0])) >= 0)
+	    counters++;
+
+    for (i = 0; i < FCYC_EVENTS; i++)
+	best_counts[i] = -1;
+    return counters;
+#else
+    return 0;
+#endif
+}
+
+/* 
+ * get_fcyc_counters - Counts of the sample returned by the last fcyc,
+ *     -1 for an event that could not be counted
+ */
+int get_fcyc_counters(double counts[FCYC_EVENTS])
+{
+    if (!counters)
+	return 0;
+    memcpy(counts, best_counts, sizeof(best_counts));
+    return 1;
+}
+
+/* 
+ * set_fcyc_cpu - Pin the process to CPU cpu, or to the current one if -1
+ */
+int set_fcyc_cpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0 && (cpu = sched_getcpu()) < 0)
+	return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    return -1;
+#endif
+}
@@ -63,6 +63,47 @@ void set_fcyc_maxsamples(int maxsamples_arg);
  */
 void set_fcyc_epsilon(double epsilon_arg);
 
+/*********************************************************
+ * Hardware performance counters (Linux perf_event_open)
+ *********************************************************/
+
+/* The events counted around each sample, in this order */
+enum {
+    FCYC_CYCLES,        /* core cycles, unlike the TSC of the samples */
+    FCYC_INSTRUCTIONS,
+    FCYC_L1D_MISSES,    /* L1 data cache read misses */
+    FCYC_LLC_MISSES,    /* last level cache misses */
+    FCYC_DTLB_MISSES,   /* data TLB read misses */
+    FCYC_BRANCH_MISSES, /* mispredicted branches */
+    FCYC_EVENTS
+};
+
+/* 
+ * set_fcyc_counters - When set, will count the events above around
+ *     each sample.  Returns the number of events the kernel lets us
+ *     count, 0 if none (not Linux, or perf_event_paranoid too high).
+ *     Default = 0
+ */
+int set_fcyc_counters(int counters_arg);
+
+/* 
+ * get_fcyc_counters - Counts of the sample returned by the last fcyc,
+ *     -1 for an event that could not be counted.
+ *     Returns 0 if counters are off.
+ */
+int get_fcyc_counters(double counts[FCYC_EVENTS]);
+
+/* 
+ * set_fcyc_cpu - Pin the process to CPU cpu, or to the CPU it runs on
+ *     if cpu is -1, so the samples do not migrate.  Returns 0 if pinned.
+ */
+int set_fcyc_cpu(int cpu);
 
+/* 
+ * set_fcyc_warmup - Number of untimed runs of f before the samples,
+ *     to fault in its pages and train caches and predictors.
+ *     Default = 0
+ */
+void set_fcyc_warmup(int runs);
 
 
@@ -0,0 +1,542 @@
+/*
+ * gentrace.c - Generate a synthetic .rep trace for mdriver from
+ *     parameterized models of sizes, lifetimes and request patterns.
+ *
+ * A trace is a sequence of phases, one per argument, each a list of
+ * key=value settings separated by commas:
+ *
+ *     ops=<n>          requests in the phase (default 10000)
+ *     size=<dist>      request sizes (default powerlaw:16:4096:1.5)
+ *     life=<dist>      lifetimes, in requests (default exp:1000)
+ *     align=<a>:<p>    a fraction p of the allocs are memaligns to a
+ *                      (default none)
+ *     calloc=<p>       a fraction p of the other allocs are callocs
+ *                      (default 0)
+ *     pattern=<p>      random          alloc, and free when the lifetime ends
+ *                      prodcons:<q>    bursts of up to q allocs, then frees
+ *                                      of up to q blocks, oldest first
+ *                      chain:<n>:<g>   realloc chains: a block grows n times
+ *                                      by a factor g, then is freed
+ *                      request:<n>     requests of up to n blocks, all freed
+ *                                      together, in any order, as each ends
+ *
+ *     <dist>           fixed:<n>
+ *                      uniform:<lo>:<hi>
+ *                      powerlaw:<lo>:<hi>:<alpha>
+ *                      bimodal:<a>:<b>:<p>     a with probability p, else b
+ *                      exp:<mean>
+ *
+ * A phase starts with the blocks the previous phases left alive, so a
+ * phase change is just the next argument. e.g.
+ *
+ *     gentrace -s 7 ops=50000,size=fixed:64 \
+ *              ops=50000,size=bimodal:24:3000:0.9,pattern=prodcons:200
+ *
+ * The blocks still alive at the end are freed, unless -k is given.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Largest size in a request, mdriver reads them as int */
+#define MAX_SIZE (1 << 30)
+
+/* Realloc chains growing at once in a chain phase */
+#define CHAINS 8
+
+/* A size or lifetime distribution */
+typedef struct {
+    enum { D_FIXED, D_UNIFORM, D_POWERLAW, D_BIMODAL, D_EXP } type;
+    double a, b, c;
+} dist_t;
+
+/* The settings of one phase */
+typedef struct {
+    long ops;
+    dist_t size;
+    dist_t life;
+    enum { P_RANDOM, P_PRODCONS, P_CHAIN, P_REQUEST } pattern;
+    long queue;          /* prodcons, request: most blocks in a burst */
+    long chain_len;      /* chain: reallocs per chain */
+    double chain_grow;   /* chain: size factor per realloc */
+    long align;          /* alignment of the memaligns, or 0 */
+    double align_p;      /* fraction of the allocs that are memaligns */
+    double calloc_p;     /* fraction of the other allocs that are callocs */
+} phase_t;
+
+/* One request of the trace */
+typedef struct {
+    char type;           /* 'a', 'm', 'c', 'f' or 'r' */
+    int id;
+    int size;
+    int align;           /* 'm' only */
+} op_t;
+
+/* A live block, and when it dies (for the random pattern) */
+typedef struct {
+    long death;
+    int id;
+    int size;
+} block_t;
+
+static op_t *ops;
+static long num_ops, max_ops;
+static int num_ids;
+
+/* min-heap of the live blocks of the random pattern, by death */
+static block_t *heap;
+static long heap_n, heap_max;
+
+/* FIFO of the live blocks of the prodcons pattern */
+static block_t *fifo;
+static long fifo_head, fifo_tail, fifo_max;
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/*
+ * rng - xorshift64, so that a seed gives the same trace everywhere
+ */
+static unsigned long long rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* uniform in [0, 1) */
+static double rng_unit(void)
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-hk] [-s <seed>] [-w <weight>] "
+            "[-i] phase...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-s <seed>   Seed of the generator (default 1).\n");
+    fprintf(stderr, "\t-w <w>      Weight in the header (default 1).\n");
+    fprintf(stderr, "\t-i          Let mdriver skip its overlap checks.\n");
+    fprintf(stderr, "\t-k          Keep the last blocks alive.\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "A phase is key=value,... with the keys ops, size, "
+            "life, align, calloc and pattern.\n");
+    fprintf(stderr, "See the comment at the top of gentrace.c.\n");
+}
+
+static void app_error(const char *msg, const char *arg)
+{
+    fprintf(stderr, "gentrace: %s: %s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * parse_dist - read a distribution such as "powerlaw:16:4096:1.5"
+ */
+static dist_t parse_dist(const char *s)
+{
+    dist_t d;
+    int n;
+
+    memset(&d, 0, sizeof(d));
+    if (sscanf(s, "fixed:%lf%n", &d.a, &n) == 1 && !s[n])
+        d.type = D_FIXED;
+    else if (sscanf(s, "uniform:%lf:%lf%n", &d.a, &d.b, &n) == 2 && !s[n])
+        d.type = D_UNIFORM;
+    else if (sscanf(s, "powerlaw:%lf:%lf:%lf%n", &d.a, &d.b, &d.c, &n) == 3
+             && !s[n])
+        d.type = D_POWERLAW;
+    else if (sscanf(s, "bimodal:%lf:%lf:%lf%n", &d.a, &d.b, &d.c, &n) == 3
+             && !s[n])
+        d.type = D_BIMODAL;
+    else if (sscanf(s, "exp:%lf%n", &d.a, &n) == 1 && !s[n])
+        d.type = D_EXP;
+    else
+        app_error("bad distribution", s);
+
+    if (d.a < 0 || d.b < 0 ||
+        ((d.type == D_UNIFORM || d.type == D_POWERLAW) &&
+         (d.a < 1 || d.b < d.a)))
+        app_error("bad bounds in distribution", s);
+    return d;
+}
+
+/*
+ * sample - draw a value of a distribution, at least 1
+ */
+static long sample(const dist_t *d)
+{
+    double u = rng_unit(), x;
+
+    switch (d->type) {
+    case D_FIXED:
+        x = d->a;
+        break;
+    case D_UNIFORM:
+        x = d->a + u * (d->b - d->a + 1);
+        break;
+    case D_POWERLAW:
+        /* inverse CDF of a power law p(x) ~ x^-alpha on [a, b] */
+        if (fabs(d->c - 1) < 1e-9) {
+            x = d->a * pow(d->b / d->a, u);
+        } else {
+            double e = 1 - d->c;
+            x = pow(pow(d->a, e) + u * (pow(d->b, e) - pow(d->a, e)), 1 / e);
+        }
+        break;
+    case D_BIMODAL:
+        x = u < d->c ? d->a : d->b;
+        break;
+    case D_EXP:
+        x = -d->a * log(1 - u);
+        break;
+    default:
+        x = 1;
+    }
+    if (x < 1)
+        x = 1;
+    return x > MAX_SIZE ? MAX_SIZE : (long)x;
+}
+
+/*
+ * parse_phase - read the settings of a phase such as
+ *               "ops=5000,size=fixed:64,pattern=chain:10:1.5"
+ */
+static phase_t parse_phase(char *s)
+{
+    phase_t p;
+    char *kv, *val;
+    int n;
+
+    p.ops = 10000;
+    p.size = parse_dist("powerlaw:16:4096:1.5");
+    p.life = parse_dist("exp:1000");
+    p.pattern = P_RANDOM;
+    p.queue = 0;
+    p.chain_len = 0;
+    p.chain_grow = 0;
+    p.align = 0;
+    p.align_p = 0;
+    p.calloc_p = 0;
+
+    for (kv = strtok(s, ","); kv; kv = strtok(NULL, ",")) {
+        if ((val = strchr(kv, '=')) == NULL)
+            app_error("expected key=value", kv);
+        *val++ = '\0';
+
+        if (!strcmp(kv, "ops")) {
+            if ((p.ops = atol(val)) <= 0)
+                app_error("bad number of requests", val);
+        } else if (!strcmp(kv, "size")) {
+            p.size = parse_dist(val);
+        } else if (!strcmp(kv, "life")) {
+            p.life = parse_dist(val);
+        } else if (!strcmp(kv, "align")) {
+            if (sscanf(val, "%ld:%lf%n", &p.align, &p.align_p, &n) != 2 ||
+                val[n] || p.align <= 0 || (p.align & (p.align - 1)) ||
+                p.align > MAX_SIZE || p.align_p < 0 || p.align_p > 1)
+                app_error("bad alignment", val);
+        } else if (!strcmp(kv, "calloc")) {
+            if (sscanf(val, "%lf%n", &p.calloc_p, &n) != 1 || val[n] ||
+                p.calloc_p < 0 || p.calloc_p > 1)
+                app_error("bad calloc fraction", val);
+        } else if (!strcmp(kv, "pattern")) {
+            if (!strcmp(val, "random"))
+                p.pattern = P_RANDOM;
+            else if (sscanf(val, "prodcons:%ld%n", &p.queue, &n) == 1
+                     && !val[n] && p.queue > 0)
+                p.pattern = P_PRODCONS;
+            else if (sscanf(val, "chain:%ld:%lf%n", &p.chain_len,
+                            &p.chain_grow, &n) == 2
+                     && !val[n] && p.chain_len > 0 && p.chain_grow > 0)
+                p.pattern = P_CHAIN;
+            else if (sscanf(val, "request:%ld%n", &p.queue, &n) == 1
+                     && !val[n] && p.queue > 0)
+                p.pattern = P_REQUEST;
+            else
+                app_error("bad pattern", val);
+        } else {
+            app_error("unknown key", kv);
+        }
+    }
+    return p;
+}
+
+/*
+ * emit - append a request to the trace
+ */
+static void emit(char type, int id, int size)
+{
+    if (num_ops == max_ops) {
+        max_ops = max_ops ? 2 * max_ops : 4096;
+        if ((ops = realloc(ops, max_ops * sizeof(op_t))) == NULL)
+            app_error("out of memory", "ops");
+    }
+    ops[num_ops].type = type;
+    ops[num_ops].id = id;
+    ops[num_ops].size = size;
+    ops[num_ops].align = 0;
+    num_ops++;
+}
+
+static int new_block(const phase_t *p, int size)
+{
+    if (p->align && rng_unit() < p->align_p) {
+        emit('m', num_ids, size);
+        ops[num_ops - 1].align = p->align;
+    } else {
+        emit(p->calloc_p && rng_unit() < p->calloc_p ? 'c' : 'a',
+             num_ids, size);
+    }
+    return num_ids++;
+}
+
+/* min-heap by death */
+static void heap_push(block_t b)
+{
+    long i;
+
+    if (heap_n == heap_max) {
+        heap_max = heap_max ? 2 * heap_max : 1024;
+        if ((heap = realloc(heap, heap_max * sizeof(block_t))) == NULL)
+            app_error("out of memory", "heap");
+    }
+    for (i = heap_n++; i > 0 && heap[(i - 1) / 2].death > b.death;
+         i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = b;
+}
+
+static block_t heap_pop(void)
+{
+    block_t top = heap[0], last = heap[--heap_n];
+    long i = 0, c;
+
+    while ((c = 2 * i + 1) < heap_n) {
+        if (c + 1 < heap_n && heap[c + 1].death < heap[c].death)
+            c++;
+        if (heap[c].death >= last.death)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* FIFO, as a growing array */
+static void fifo_push(block_t b)
+{
+    if (fifo_tail == fifo_max) {
+        fifo_max = fifo_max ? 2 * fifo_max : 1024;
+        if ((fifo = realloc(fifo, fifo_max * sizeof(block_t))) == NULL)
+            app_error("out of memory", "fifo");
+    }
+    fifo[fifo_tail++] = b;
+}
+
+/*
+ * run_random - allocate a block per step, free each block when its
+ *              lifetime (counted in requests) is over
+ */
+static void run_random(const phase_t *p)
+{
+    long end = num_ops + p->ops;
+    block_t b;
+
+    while (num_ops < end) {
+        while (heap_n > 0 && heap[0].death <= num_ops && num_ops < end) {
+            b = heap_pop();
+            emit('f', b.id, 0);
+        }
+        if (num_ops >= end)
+            break;
+        b.size = sample(&p->size);
+        b.id = new_block(p, b.size);
+        b.death = num_ops + sample(&p->life);
+        heap_push(b);
+    }
+}
+
+/*
+ * run_prodcons - a producer allocates a burst of blocks, then a consumer
+ *                frees a burst of the oldest ones
+ */
+static void run_prodcons(const phase_t *p)
+{
+    long end = num_ops + p->ops;
+    long n;
+    block_t b;
+
+    while (num_ops < end) {
+        for (n = 1 + rng() % p->queue; n > 0 && num_ops < end; n--) {
+            b.size = sample(&p->size);
+            b.id = new_block(p, b.size);
+            b.death = 0;
+            fifo_push(b);
+        }
+        for (n = 1 + rng() % p->queue;
+             n > 0 && fifo_head < fifo_tail && num_ops < end; n--)
+            emit('f', fifo[fifo_head++].id, 0);
+    }
+}
+
+/*
+ * run_request - a request allocates a burst of blocks, and frees all of
+ *               them, shuffled, when it ends
+ */
+static void run_request(const phase_t *p)
+{
+    long end = num_ops + p->ops;
+    long n, i;
+    block_t b;
+
+    while (num_ops < end) {
+        for (n = 1 + rng() % p->queue; n > 0 && num_ops < end; n--) {
+            b.size = sample(&p->size);
+            b.id = new_block(p, b.size);
+            b.death = 0;
+            fifo_push(b);
+        }
+        for (; fifo_head < fifo_tail && num_ops < end; fifo_head++) {
+            i = fifo_head + rng() % (fifo_tail - fifo_head);
+            b = fifo[i];
+            fifo[i] = fifo[fifo_head];
+            emit('f', b.id, 0);
+        }
+        /* a request cut short by the end of the phase is left in the FIFO */
+        if (fifo_head == fifo_tail)
+            fifo_head = fifo_tail = 0;
+    }
+}
+
+/*
+ * run_chain - CHAINS blocks grow by reallocs at random, each chain is
+ *             freed after chain_len reallocs and a new one starts
+ */
+static void run_chain(const phase_t *p)
+{
+    long end = num_ops + p->ops;
+    block_t chain[CHAINS];
+    long len[CHAINS];
+    int i;
+
+    /* a phase shorter than CHAINS leaves the last chains unstarted */
+    for (i = 0; i < CHAINS; i++)
+        chain[i].id = -1;
+    for (i = 0; i < CHAINS && num_ops < end; i++) {
+        chain[i].size = sample(&p->size);
+        chain[i].id = new_block(p, chain[i].size);
+        len[i] = 0;
+    }
+    while (num_ops < end) {
+        i = rng() % CHAINS;
+        if (len[i] == p->chain_len) {
+            emit('f', chain[i].id, 0);
+            chain[i].size = sample(&p->size);
+            chain[i].id = -1;
+            if (num_ops < end) {
+                chain[i].id = new_block(p, chain[i].size);
+                len[i] = 0;
+            }
+            continue;
+        }
+        if (chain[i].size * p->chain_grow < MAX_SIZE)
+            chain[i].size = chain[i].size * p->chain_grow + 0.5;
+        if (chain[i].size < 1)
+            chain[i].size = 1;
+        emit('r', chain[i].id, chain[i].size);
+        len[i]++;
+    }
+
+    /* the chains cut short by the end of the phase live on */
+    for (i = 0; i < CHAINS; i++) {
+        if (chain[i].id >= 0) {
+            chain[i].death = num_ops + sample(&p->life);
+            heap_push(chain[i]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int weight = 1, ignore_ranges = 0, keep = 0;
+    long i;
+    int c;
+    phase_t phase;
+
+    while ((c = getopt(argc, argv, "s:w:ikh")) != -1) {
+        switch (c) {
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) * 2654435761ULL + 1;
+            break;
+        case 'w':
+            weight = atoi(optarg);
+            if (weight < 0 || weight > 3)
+                app_error("weight can only be in {0, 1, 2, 3}", optarg);
+            break;
+        case 'i':
+            ignore_ranges = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+        usage();
+        exit(1);
+    }
+
+    for (; optind < argc; optind++) {
+        phase = parse_phase(argv[optind]);
+        switch (phase.pattern) {
+        case P_RANDOM:
+            run_random(&phase);
+            break;
+        case P_PRODCONS:
+            run_prodcons(&phase);
+            break;
+        case P_CHAIN:
+            run_chain(&phase);
+            break;
+        case P_REQUEST:
+            run_request(&phase);
+            break;
+        }
+        /* the FIFO blocks left by a producer die like the others */
+        for (; fifo_head < fifo_tail; fifo_head++) {
+            fifo[fifo_head].death = num_ops + sample(&phase.life);
+            heap_push(fifo[fifo_head]);
+        }
+        fifo_head = fifo_tail = 0;
+    }
+
+    if (!keep)
+        while (heap_n > 0)
+            emit('f', heap_pop().id, 0);
+
+    if (num_ids == 0)
+        app_error("the trace has no blocks", argv[argc - 1]);
+
+    /* the header mdriver expects, then the requests */
+    printf("%d\n%d\n%ld\n%d\n", weight, num_ids, num_ops, ignore_ranges);
+    for (i = 0; i < num_ops; i++) {
+        if (ops[i].type == 'f')
+            printf("f %d\n", ops[i].id);
+        else if (ops[i].type == 'm')
+            printf("m %d %d %d\n", ops[i].id, ops[i].size, ops[i].align);
+        else
+            printf("%c %d %d\n", ops[i].type, ops[i].id, ops[i].size);
+    }
+    return 0;
+}
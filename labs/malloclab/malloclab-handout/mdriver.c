@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,11 +19,20 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fcyc.h"
 #include "config.h"
 
 /**********************
@@ -54,32 +64,57 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload, in a treap ordered by lo.
+ * The payloads never overlap, so the one starting last at or before hi
+ * is the only one a new payload [lo, hi] can overlap.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* payloads below lo */
+    struct range_t *right; /* payloads above hi */
+    unsigned priority;     /* random, a parent's is never smaller */
     int index;             /* same index as free; for debugging */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, CALLOC } type; /* type of request */
     int index;                        /* index for free() to use later */
     size_t size;                      /* byte size of alloc/realloc request */
+    size_t align;                     /* alignment of a memalign, else 0 */
 } traceop_t;
 
+/*
+ * The header of a binary trace file (written by -b), followed by the
+ * num_ops requests as an array of traceop_t, ready to be mmap'd.
+ */
+#define TRACE_MAGIC 0x32544d4d /* "MMT2" */
+#define TRACE_MAGIC_OLD 0x52544d4d /* "MMTR", before memalign requests */
+typedef struct {
+    int magic;
+    int weight;
+    int num_ids;
+    int num_ops;
+    int ignore_ranges;
+    int pad[3];          /* keeps the requests 16-byte aligned */
+} tracebin_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
     char filename[MAXLINE];
-    int ignore_ranges;   /* don't check ranges (i.e. this is too big) */
+    int ignore_ranges;   /* was: too big to check ranges, see add_range */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
     traceop_t *ops;      /* array of requests */
+    void *map;           /* the mmap'd binary trace file holding ops... */
+    size_t map_size;     /* ... and its size, or NULL and 0 for a .rep */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
     int *block_rand_base;/* index into random_data, if debug is on */
+    unsigned char *hints;/* lifetime of each alloc request (-H), or NULL */
 } trace_t;
 
 /*
@@ -105,10 +140,29 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t rss_peak; /* most bytes of the heap resident during the trace */
+    size_t rss_final;/* bytes of the heap resident at its end */
+    double counts[FCYC_EVENTS]; /* hardware events of the timed run (-P) */
+    size_t heap_peak;     /* most bytes below the brk in the timed run */
+    double arena_secs;    /* the arena replay (-R), 0 if it ran out of heap */
+    size_t arena_heap_peak;
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+#ifdef THREAD_SAFE
+/* The params of one thread replaying a trace in the multithreaded mode */
+typedef struct {
+    trace_t *trace;
+    pthread_barrier_t *start;
+    char **blocks;       /* this thread's own blocks... */
+    size_t *block_sizes; /* ... and their sizes */
+    int id;
+    int errors;          /* blocks found overwritten by another thread */
+    struct timespec begin, end; /* when this thread started and finished */
+} mt_worker_t;
+#endif
+
 /* Summarizes the key statistics for a set of traces */
 typedef struct {
     double util;  /* average utilization expressed as a percentage */
@@ -144,6 +198,42 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* number of traces checked at once in worker processes (-j) */
+static int jobs = 1;
+
+/* number of slowest requests listed by the latency mode (-L), -1 if off */
+static int latency_top = -1;
+
+/* number of hardware events counted by fcyc (-P), 0 if off */
+static int perf_counters = 0;
+
+/* requests between an alloc and its free that make a short-lived block (-H),
+   a medium-lived one lives up to HINT_MEDIUM times longer; 0 if off */
+static int hint_distance = 0;
+#define HINT_MEDIUM 16
+
+/* replay each trace on an mm_arena too (-R), 0 if off */
+static int arena_mode = 0;
+static int arena_failed;        /* the arena replay ran out of heap */
+
+/* where the heap shape is written during the utilization pass (-F) */
+static FILE *profile_file = NULL;
+#define PROFILE_SAMPLES 200     /* heap walks per trace */
+
+/*
+ * eval_mm_valid measures the resident bytes every RSS_INTERVAL requests,
+ * and whenever the heap and the mapped regions grew by 1/RSS_GROWTH since
+ * the last measure, as a walk of the pages after each request would make
+ * the check O(ops * pages).
+ */
+#define RSS_INTERVAL    256
+#define RSS_GROWTH      16
+
+#ifdef THREAD_SAFE
+/* max number of threads replaying each trace (-T), 0 if not set */
+static int mt_threads = 0;
+#endif
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -162,11 +252,12 @@ sum_stats_t global_mm_sum_stats;
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void check_ranges(const trace_t *trace, int opnum, range_t *ranges);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -177,7 +268,12 @@ static void randomize_block(trace_t *trace, int index);
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
+static void read_trace_bin(trace_t *trace, int fd);
+static void write_trace_bin(const trace_t *trace, const char *filename);
+static void convert_traces(int num_tracefiles, const char *tracedir,
+                           char **tracefiles, const char *bindir);
 static void free_trace(trace_t *trace);
+static unsigned char *lifetime_hints(const trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace);
@@ -185,12 +281,22 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, range_t **ranges, stats_t *stats);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace);
+static void eval_mm_arena(trace_t *trace, stats_t *stats, speed_t *params);
+static void eval_arena_speed(void *ptr);
+static void profile_heap(const trace_t *trace, int opnum, int payload);
+#ifdef THREAD_SAFE
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void print_counters(int n, stats_t *stats);
+static void print_arena(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -208,6 +314,112 @@ static void timeout_handler(int sig __attribute__((unused))) {
     longjmp(timeout_jmpbuf, 1);
 }
 
+/* What a worker process of run_checks found about one trace */
+typedef struct {
+    int valid;
+    double util;
+    size_t rss_peak;
+    size_t rss_final;
+    int errors;
+} check_t;
+
+/*
+ * check_trace - run the validity and utilization passes of one trace in
+ *               a worker process, on its own simulated heap, and send the
+ *               results back through fd.
+ */
+static void check_trace(int i, const char *tracedir, char *tracefile, int fd)
+{
+    stats_t stats;
+    range_t *ranges = NULL;
+    check_t check;
+    trace_t *trace;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&check, 0, sizeof(check));
+
+    if (mem_init() < 0)
+        unix_error("mem_init failed");
+    trace = read_trace(&stats, tracedir, tracefile);
+    check.valid = eval_mm_valid(trace, &ranges, &stats);
+    if (check.valid)
+        check.util = eval_mm_util(trace, i);
+    check.rss_peak = stats.rss_peak;
+    check.rss_final = stats.rss_final;
+    check.errors = errors;
+
+    if (write(fd, &check, sizeof(check)) != sizeof(check))
+        _exit(1);
+    _exit(0);
+}
+
+/*
+ * run_checks - run the validity and utilization passes of every trace,
+ *              up to <jobs> traces at once in worker processes.
+ *              A worker that dies leaves its trace invalid.
+ */
+static void run_checks(int num_tracefiles, const char *tracedir,
+                       char **tracefiles, stats_t *mm_stats)
+{
+    pid_t *pids;
+    int *fds;
+    int next = 0, running = 0;
+    int i, fd[2], status;
+    pid_t pid;
+    check_t check;
+
+    if ((pids = calloc(num_tracefiles, sizeof(pid_t))) == NULL ||
+        (fds = calloc(num_tracefiles, sizeof(int))) == NULL)
+        unix_error("calloc failed in run_checks");
+
+    while (next < num_tracefiles || running > 0) {
+        /* keep <jobs> workers busy */
+        if (next < num_tracefiles && running < jobs) {
+            if (pipe(fd) < 0)
+                unix_error("pipe failed in run_checks");
+            if ((pid = fork()) < 0)
+                unix_error("fork failed in run_checks");
+            if (pid == 0) {
+                close(fd[0]);
+                check_trace(next, tracedir, tracefiles[next], fd[1]);
+            }
+            close(fd[1]);
+            pids[next] = pid;
+            fds[next] = fd[0];
+            next++;
+            running++;
+            continue;
+        }
+
+        /* the results are small enough not to block a worker on the pipe */
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in run_checks");
+        for (i = 0; i < next && pids[i] != pid; i++)
+            ;
+        if (i == next)
+            continue;
+        running--;
+
+        if (read(fds[i], &check, sizeof(check)) != sizeof(check)) {
+            fprintf(stderr, "ERROR [trace %s]: checker %s\n", tracefiles[i],
+                    WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) :
+                    "exited without results");
+            memset(&check, 0, sizeof(check));
+            check.errors = 1;
+        }
+        close(fds[i]);
+
+        mm_stats[i].valid = check.valid;
+        mm_stats[i].util = check.util;
+        mm_stats[i].rss_peak = check.rss_peak;
+        mm_stats[i].rss_final = check.rss_final;
+        errors += check.errors;
+    }
+
+    free(pids);
+    free(fds);
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, const char *tracedir,
@@ -215,11 +427,19 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                       stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
     volatile int i;
     volatile int timed_out = 0;
+    volatile int checked = 0; /* validity and utilization done by -j */
+
+    /* the workers of -j would interleave their lines of -F */
+    if (jobs > 1 && !onetime_flag && !profile_file) {
+        run_checks(num_tracefiles, tracedir, tracefiles, mm_stats);
+        checked = 1;
+    }
 
     for (i=0; i < num_tracefiles; i++) {
         /* initialize simulated memory system in memlib.c *
          * start each trace with a clean system */
-        mem_init();
+        if (mem_init() < 0)
+            unix_error("mem_init failed");
 
         /* handle timeouts */
         if(setjmp(timeout_jmpbuf) != 0) {
@@ -232,10 +452,10 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         mm_stats[i].ops = trace->num_ops;
         if(timed_out) {
             mm_stats[i].valid = 0;
-        } else {
+        } else if (!checked) {
             if (verbose > 1)
                 printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid = eval_mm_valid(trace, &ranges);
+            mm_stats[i].valid = eval_mm_valid(trace, &ranges, &mm_stats[i]);
 
             if (onetime_flag) {
                 free_trace(trace);
@@ -245,12 +465,19 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            if (!checked)
+                mm_stats[i].util = eval_mm_util(trace, i);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            if (perf_counters)
+                get_fcyc_counters(mm_stats[i].counts);
+            if (arena_mode)
+                eval_mm_arena(trace, &mm_stats[i], speed_params);
+            if (latency_top >= 0)
+                eval_mm_latency(trace);
         }
 
         free_trace(trace);
@@ -291,7 +518,9 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpVAlD")) != EOF) {
+    char *bindir = NULL;       /* convert the traces into it (-b) */
+
+    while ((c = getopt(argc, argv, "b:d:f:c:j:s:t:v:hpPRVAlDF:H:L:T:")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -352,6 +581,49 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'j': /* Check up to n traces at once */
+            jobs = atoi(optarg);
+            if (jobs < 1)
+                app_error("-j needs at least one job\n");
+            break;
+
+        case 'L': /* Time every request, list the n slowest */
+            latency_top = atoi(optarg);
+            if (latency_top < 0)
+                app_error("-L needs a count of at least zero\n");
+            break;
+
+        case 'F': /* Write the shape of the heap as the traces run */
+            if ((profile_file = fopen(optarg, "w")) == NULL)
+                unix_error("ERROR: could not open %s", optarg);
+            break;
+
+        case 'H': /* Pass the lifetime of each block to mm_malloc_hint */
+            hint_distance = atoi(optarg);
+            if (hint_distance < 1)
+                app_error("-H needs a distance of at least one request\n");
+            break;
+
+        case 'R': /* Compare with an arena freed as each request ends */
+            arena_mode = 1;
+            break;
+
+        case 'P': /* Count hardware events of the timed runs */
+            perf_counters = 1;
+            break;
+
+        case 'b': /* Convert the traces to binary traces in a directory */
+            bindir = optarg;
+            break;
+
+#ifdef THREAD_SAFE
+        case 'T': /* Replay each trace across 1..n threads */
+            mt_threads = atoi(optarg);
+            if (mt_threads < 1)
+                app_error("-T needs at least one thread\n");
+            break;
+#endif
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -368,6 +640,11 @@ int main(int argc, char **argv)
         printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    if (bindir) {
+        convert_traces(num_tracefiles, tracedir, tracefiles, bindir);
+        exit(0);
+    }
+
     if(debug_mode != DBG_NONE) {
         init_random_data();
     }
@@ -375,6 +652,25 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* Pin to one CPU, warm up, and count hardware events around fcyc */
+    if (perf_counters) {
+        if (set_fcyc_cpu(-1) < 0)
+            fprintf(stderr, "Warning: could not pin mdriver to a CPU\n");
+        set_fcyc_warmup(1);
+        if ((perf_counters = set_fcyc_counters(1)) == 0)
+            fprintf(stderr, "Warning: hardware counters unavailable "
+                    "(perf_event_paranoid?), -P ignored\n");
+        else if (verbose > 1)
+            printf("Counting %d hardware events per run.\n", perf_counters);
+    }
+
+#ifdef THREAD_SAFE
+    if (mt_threads) {
+        run_mt_tests(num_tracefiles, tracedir, tracefiles);
+        exit(0);
+    }
+#endif
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
@@ -445,6 +741,14 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (perf_counters) {
+                print_counters(num_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (arena_mode) {
+                print_arena(num_tracefiles, mm_stats);
+                printf("\n");
+            }
         }
     }
 
@@ -580,16 +884,96 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks, in
+ * O(log n) expected time per request.
  ****************************************************************/
 
+/*
+ * range_priority - xorshift, the priorities of the treap
+ */
+static unsigned range_priority(void)
+{
+    static unsigned x = 15213;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/*
+ * find_range - the range starting last at or before addr, or NULL
+ */
+static range_t *find_range(range_t *ranges, char *addr)
+{
+    range_t *found = NULL;
+
+    while (ranges != NULL) {
+        if (ranges->lo <= addr) {
+            found = ranges;
+            ranges = ranges->right;
+        }
+        else
+            ranges = ranges->left;
+    }
+    return found;
+}
+
+/*
+ * insert_range - insert p below *ranges, rotating it up to its priority
+ */
+static void insert_range(range_t **ranges, range_t *p)
+{
+    range_t *t = *ranges;
+
+    if (t == NULL) {
+        *ranges = p;
+        return;
+    }
+
+    if (p->lo < t->lo) {
+        insert_range(&t->left, p);
+        if (t->left->priority > t->priority) {
+            *ranges = t->left;
+            t->left = (*ranges)->right;
+            (*ranges)->right = t;
+        }
+    }
+    else {
+        insert_range(&t->right, p);
+        if (t->right->priority > t->priority) {
+            *ranges = t->right;
+            t->right = (*ranges)->left;
+            (*ranges)->left = t;
+        }
+    }
+}
+
+/*
+ * merge_ranges - join two treaps, every payload of l below those of r
+ */
+static range_t *merge_ranges(range_t *l, range_t *r)
+{
+    if (l == NULL)
+        return r;
+    if (r == NULL)
+        return l;
+
+    if (l->priority > r->priority) {
+        l->right = merge_ranges(l->right, r);
+        return l;
+    }
+    r->left = merge_ranges(l, r->left);
+    return r;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index)
@@ -606,42 +990,43 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap,
+       or within a region mapped by mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !(mem_is_mapped(lo) && mem_is_mapped(hi))) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return 0;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
-    if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
+    /* Without debugging the overlap is left to the random bits.
+       ignore_ranges is kept in the trace format, but the tree no longer
+       makes the check too expensive for big traces. */
+    if(debug_mode == DBG_NONE) return 1;
 
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            malloc_error(trace, opnum,
-                         "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                         lo, hi, p->lo, p->hi);
-            return 0;
-        }
+    if ((p = find_range(*ranges, hi)) != NULL && p->hi >= lo) {
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                     lo, hi, p->lo, p->hi);
+        return 0;
     }
 
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
         unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
+    p->priority = range_priority();
     p->index = index;
-    *ranges = p;
+    insert_range(ranges, p);
 
     return 1;
 }
@@ -652,15 +1037,13 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo)
 {
     range_t *p;
-    range_t **prevpp = ranges;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    while ((p = *ranges) != NULL && p->lo != lo)
+        ranges = lo < p->lo ? &p->left : &p->right;
+
+    if (p != NULL) {
+        *ranges = merge_ranges(p->left, p->right);
+        free(p);
     }
 }
 
@@ -669,16 +1052,26 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    if (*ranges == NULL)
+        return;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    clear_ranges(&(*ranges)->left);
+    clear_ranges(&(*ranges)->right);
+    free(*ranges);
     *ranges = NULL;
 }
 
+/*
+ * check_ranges - check the data of every block in the range tree
+ */
+static void check_ranges(const trace_t *trace, int opnum, range_t *ranges)
+{
+    for (; ranges != NULL; ranges = ranges->right) {
+        check_ranges(trace, opnum, ranges->left);
+        check_index(trace, opnum, ranges->index);
+    }
+}
+
 /**********************************************
  * The following routines handle the random data used for
  * checking memory access.
@@ -754,9 +1147,10 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    int index, size;
+    int index, size, align;
     int max_index = 0;
     int op_index;
+    int magic;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -765,16 +1159,27 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
 
-    /* Read the trace file header */
-    strcpy(trace->filename, tracedir);
+    /* Read the trace file header (an absolute path ignores tracedir) */
+    strcpy(trace->filename, filename[0] == '/' ? "" : tracedir);
     strcat(trace->filename, filename);
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
-    fscanf(tracefile, "%d", &trace->weight);
-    fscanf(tracefile, "%d", &trace->num_ids);
-    fscanf(tracefile, "%d", &trace->num_ops);
-    fscanf(tracefile, "%d", &trace->ignore_ranges);
+    trace->map = NULL;
+    trace->map_size = 0;
+    if (fread(&magic, sizeof(magic), 1, tracefile) == 1 &&
+        magic == TRACE_MAGIC) {
+        read_trace_bin(trace, fileno(tracefile));
+    } else if (magic == TRACE_MAGIC_OLD) {
+        app_error("%s: binary trace of an older mdriver, convert it again "
+                  "with -b", trace->filename);
+    } else {
+        rewind(tracefile);
+        fscanf(tracefile, "%d", &trace->weight);
+        fscanf(tracefile, "%d", &trace->num_ids);
+        fscanf(tracefile, "%d", &trace->num_ops);
+        fscanf(tracefile, "%d", &trace->ignore_ranges);
+    }
 
     if(trace->weight < 0 || trace->weight > 3) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
@@ -784,7 +1189,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     }
 
     /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
+    if (trace->map == NULL && (trace->ops =
          (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
@@ -807,7 +1212,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
+    while (trace->map == NULL && fscanf(tracefile, "%s", type) != EOF) {
+        trace->ops[op_index].align = 0;
         switch(type[0]) {
         case 'a':
             fscanf(tracefile, "%u %u", &index, &size);
@@ -816,6 +1222,24 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'm':
+            fscanf(tracefile, "%u %u %u", &index, &size, &align);
+            if (align <= 0 || (align & (align - 1)))
+                app_error("%s: alignment %d of request %d isn't a power "
+                          "of 2", trace->filename, align, op_index);
+            trace->ops[op_index].type = ALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'c':
+            fscanf(tracefile, "%u %u", &index, &size);
+            trace->ops[op_index].type = CALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'r':
             fscanf(tracefile, "%u %u", &index, &size);
             trace->ops[op_index].type = REALLOC;
@@ -836,8 +1260,12 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         if(op_index == trace->num_ops) break;
     }
     fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+    if (trace->map == NULL) {
+        assert(max_index == trace->num_ids - 1);
+        assert(trace->num_ops == op_index);
+    }
+
+    trace->hints = hint_distance ? lifetime_hints(trace) : NULL;
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -847,6 +1275,170 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     return trace;
 }
 
+/*
+ * read_trace_bin - map the requests of a binary trace file in place,
+ *                  instead of parsing them.
+ */
+static void read_trace_bin(trace_t *trace, int fd)
+{
+    struct stat st;
+    tracebin_t *hdr;
+    int i;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(tracebin_t))
+        app_error("%s: truncated binary trace", trace->filename);
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("mmap failed in read_trace_bin");
+
+    hdr = (tracebin_t *)trace->map;
+    trace->weight = hdr->weight;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->ignore_ranges = hdr->ignore_ranges;
+    trace->ops = (traceop_t *)(hdr + 1);
+
+    if (trace->num_ops < 0 || trace->map_size !=
+        sizeof(tracebin_t) + (size_t)trace->num_ops * sizeof(traceop_t))
+        app_error("%s: binary trace has the wrong size", trace->filename);
+
+    /* the requests are used as they are, so check them once here */
+    for (i = 0; i < trace->num_ops; i++) {
+        if ((trace->ops[i].type != ALLOC && trace->ops[i].type != FREE &&
+             trace->ops[i].type != REALLOC && trace->ops[i].type != CALLOC) ||
+            (trace->ops[i].type == CALLOC && trace->ops[i].align) ||
+            trace->ops[i].index < -1 ||
+            trace->ops[i].index >= trace->num_ids ||
+            (trace->ops[i].align & (trace->ops[i].align - 1)))
+            app_error("%s: bogus request %d in binary trace",
+                      trace->filename, i);
+    }
+}
+
+/*
+ * write_trace_bin - save a trace in the binary format read by
+ *                   read_trace_bin.
+ */
+static void write_trace_bin(const trace_t *trace, const char *filename)
+{
+    tracebin_t hdr;
+    FILE *fp;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.weight = trace->weight;
+    hdr.num_ids = trace->num_ids;
+    hdr.num_ops = trace->num_ops;
+    hdr.ignore_ranges = trace->ignore_ranges;
+
+    if ((fp = fopen(filename, "w")) == NULL)
+        unix_error("Could not open %s in write_trace_bin", filename);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, fp) !=
+        (size_t)trace->num_ops)
+        unix_error("Could not write %s in write_trace_bin", filename);
+    fclose(fp);
+}
+
+/*
+ * convert_traces - save every trace in <bindir> under the same name,
+ *                  in the binary format. (e.g. mdriver -t <bindir>)
+ */
+static void convert_traces(int num_tracefiles, const char *tracedir,
+                           char **tracefiles, const char *bindir)
+{
+    char filename[MAXLINE];
+    const char *base;
+    stats_t stats;
+    trace_t *trace;
+    int i;
+
+    if (mkdir(bindir, 0755) < 0 && errno != EEXIST)
+        unix_error("Could not create %s", bindir);
+
+    for (i = 0; i < num_tracefiles; i++) {
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        base = strrchr(tracefiles[i], '/');
+        base = base ? base + 1 : tracefiles[i];
+        snprintf(filename, sizeof(filename), "%s/%s", bindir, base);
+        write_trace_bin(trace, filename);
+        if (verbose > 1)
+            printf("Wrote %s\n", filename);
+        free_trace(trace);
+    }
+}
+
+/*
+ * lifetime_hints - the lifetime of the block of each alloc request,
+ *     from the number of requests until it is freed (or reallocated),
+ *     as the caller of an allocator knows it at each allocation site.
+ */
+static unsigned char *lifetime_hints(const trace_t *trace)
+{
+    unsigned char *hints;
+    int *death;
+    int i, index, distance;
+
+    if ((hints = calloc(trace->num_ops, sizeof(*hints))) == NULL ||
+        (death = malloc(trace->num_ids * sizeof(*death))) == NULL)
+        unix_error("malloc failed in lifetime_hints");
+
+    for (i = 0; i < trace->num_ids; i++)
+        death[i] = INT_MAX;
+
+    for (i = trace->num_ops - 1; i >= 0; i--) {
+        index = trace->ops[i].index;
+        if (index < 0)
+            continue;
+        if (trace->ops[i].type == ALLOC || trace->ops[i].type == CALLOC) {
+            distance = death[index] - i;
+            if (distance <= hint_distance)
+                hints[i] = MM_LIFETIME_SHORT;
+            else if (distance <= hint_distance * HINT_MEDIUM)
+                hints[i] = MM_LIFETIME_MEDIUM;
+        }
+        death[index] = i;
+    }
+
+    free(death);
+    return hints;
+}
+
+/*
+ * mm_malloc_op - mm_malloc for the alloc request i, or mm_memalign,
+ *     with its lifetime if the trace has hints, or mm_calloc.
+ */
+static inline void *mm_malloc_op(const trace_t *trace, int i, size_t size)
+{
+    if (trace->ops[i].type == CALLOC)
+        return mm_calloc(1, size);
+    if (trace->ops[i].align)
+        return mm_memalign(trace->ops[i].align, size);
+    if (trace->hints)
+        return mm_malloc_hint(size, trace->hints[i]);
+    return mm_malloc(size);
+}
+
+/*
+ * libc_malloc_op - malloc for the alloc request i, or posix_memalign,
+ *     or calloc.
+ */
+static inline void *libc_malloc_op(const trace_t *trace, int i, size_t size)
+{
+    void *p;
+
+    if (trace->ops[i].type == CALLOC)
+        return calloc(1, size);
+    if (trace->ops[i].align == 0)
+        return malloc(size);
+    if (posix_memalign(&p, trace->ops[i].align < sizeof(void *) ?
+                       sizeof(void *) : trace->ops[i].align, size) != 0)
+        return NULL;
+    return p;
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -863,10 +1455,14 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map)           /* unmap a binary trace... */
+        munmap(trace->map, trace->map_size);
+    else
+        free(trace->ops);     /* ... or free the three arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->hints);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -877,18 +1473,23 @@ static void free_trace(trace_t *trace)
 
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
+ *   Every payload is written here, as a program would, so this is also
+ *   where the peak and final resident size of the heap are recorded.
  */
-static int eval_mm_valid(trace_t *trace, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, range_t **ranges, stats_t *stats)
 {
     int i;
     int index;
-    size_t size;
+    size_t size, j;
     char *newp;
     char *oldp;
     char *p;
+    int rss_requests = 0;
+    size_t rss_footprint = 0;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
+    mem_release(mem_heap_lo(), MAX_HEAP);   /* forget the previous runs */
     clear_ranges(ranges);
     reinit_trace(trace);
 
@@ -904,37 +1505,47 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         size = trace->ops[i].size;
 
         if(debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-                        
             /* Let the students check their own heap */
             mm_checkheap(verbose);
 
             /* Now check that all our allocated blocks have the right data */
-            r = *ranges;
-            while(r) {
-                check_index(trace, i, r->index);
-                r = r->next;
-            }
+            check_ranges(trace, i, *ranges);
         }
 
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = mm_malloc_op(trace, i, size)) == NULL) {
                 malloc_error(trace, i, "mm_malloc failed.");
                 return 0;
             }
+            if ((unsigned long)p % (trace->ops[i].align ?: 1)) {
+                malloc_error(trace, i, "mm_memalign returned %p, "
+                             "not aligned to %zu.", p, trace->ops[i].align);
+                return 0;
+            }
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range tree if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
             if (add_range(ranges, p, size, trace, i, index) == 0)
                 return 0;
 
+            /* A calloc'd block must read as zero */
+            if (trace->ops[i].type == CALLOC) {
+                for (j = 0; j < size; j++)
+                    if (p[j] != 0) {
+                        malloc_error(trace, i, "mm_calloc returned a block "
+                                     "that isn't zero at byte %zu.", j);
+                        return 0;
+                    }
+            }
+
             /* Remember region */
             trace->blocks[index] = p;
             trace->block_sizes[index] = size;
@@ -960,10 +1571,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             }
 
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range tree */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range tree */
             if (size > 0) {
                 if(add_range(ranges, newp, size, trace, i, index) == 0)
                     return 0;
@@ -986,7 +1597,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         case FREE: /* mm_free */
             check_index(trace, i, index);
 
-            /* Remove region from list and call student's free function */
+            /* Remove region from tree and call student's free function */
             if(index == -1) {
                 p = 0;
             } else {
@@ -1000,7 +1611,22 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             app_error("Nonexistent request type in eval_mm_valid");
         }
 
+        if (trace->ops[i].type != FREE) {
+            size_t footprint = mem_heapsize() + mem_mapped_peak();
+
+            if (++rss_requests >= RSS_INTERVAL ||
+                footprint > rss_footprint + rss_footprint / RSS_GROWTH) {
+                size_t rss = mem_rss();
+                if (rss > stats->rss_peak)
+                    stats->rss_peak = rss;
+                rss_requests = 0;
+                rss_footprint = footprint;
+            }
+        }
     }
+    stats->rss_final = mem_rss();
+    if (stats->rss_final > stats->rss_peak)
+        stats->rss_peak = stats->rss_final;
 
     /* As far as we know, this is a valid malloc package */
     return 1;
@@ -1011,10 +1637,9 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size of the heap in bytes while running the student's malloc
+ *   package on the trace. The brk goes down when the heap is trimmed,
+ *   so the high water mark of the brk is used, not the final brk.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1028,6 +1653,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     char *p;
     char *newp, *oldp;
 
+    int interval = trace->num_ops / PROFILE_SAMPLES + 1;
+
     reinit_trace(trace);
 
     /* initialize the heap and the mm malloc package */
@@ -1039,10 +1666,11 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC: /* mm_calloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = mm_malloc_op(trace, i, size)) == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1095,14 +1723,62 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+
+        if (profile_file && (i % interval == 0 || i == trace->num_ops - 1))
+            profile_heap(trace, i, total_size);
     }
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* mapped regions count at their high water mark, like the heap */
+    return ((double)max_total_size /
+            (double)(mem_heapsize_peak() + mem_mapped_peak()));
 }
 
 
+/*
+ * print_profile_array - a counter array of mm_heapstat_t as JSON,
+ *     without its trailing zeros
+ */
+static void print_profile_array(const char *name, const int *a)
+{
+    int i, n = MM_STAT_CLASSES;
+
+    while (n > 0 && a[n-1] == 0)
+        n--;
+    fprintf(profile_file, ",\"%s\":[", name);
+    for (i = 0; i < n; i++)
+        fprintf(profile_file, "%s%d", i ? "," : "", a[i]);
+    fprintf(profile_file, "]");
+}
+
+/*
+ * profile_heap - write the shape of the heap after request opnum as a
+ *     line of JSON: the sizes, the external fragmentation
+ *     (1 - largest free block / free bytes) and the deepest treap,
+ *     then the free blocks by highest bit of size ("hist"), by linked
+ *     list ("lists") and by first level of the treaps ("treaps").
+ */
+static void profile_heap(const trace_t *trace, int opnum, int payload)
+{
+    mm_heapstat_t stat;
+    const char *name = strrchr(trace->filename, '/');
+
+    mm_heapstat(&stat);
+    fprintf(profile_file, "{\"trace\":\"%s\",\"op\":%d,\"payload\":%d,"
+            "\"heap\":%zu,\"free\":%zu,\"blocks\":%d,\"free_blocks\":%d,"
+            "\"largest_free\":%zu,\"ext_frag\":%.4f,\"treap_depth\":%d",
+            name ? name + 1 : trace->filename, opnum, payload,
+            stat.heap, stat.free_bytes, stat.blocks, stat.free_blocks,
+            stat.largest,
+            stat.free_bytes ? 1.0 - (double)stat.largest / stat.free_bytes : 0.0,
+            stat.treap_depth);
+    print_profile_array("hist", stat.hist);
+    print_profile_array("lists", stat.lists);
+    print_profile_array("treaps", stat.treaps);
+    fprintf(profile_file, "}\n");
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -1124,9 +1800,10 @@ static void eval_mm_speed(void *ptr)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm_malloc_op(trace, i, size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -1155,6 +1832,493 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * The arena mode (-R) : the trace is replayed again on an mm_arena,
+ * as a server would with its request-scoped blocks. A request begins
+ * when a block is allocated while none is live, and ends when its last
+ * block is freed: its scope is left, all its blocks are freed at once.
+ * The frees before that cost nothing, but their space isn't reused
+ * until the request ends.
+ *
+ * Traces made of requests (e.g. gentrace pattern=request:<n>) are what
+ * it is for, the others keep a block live and never free anything.
+ */
+static void eval_mm_arena(trace_t *trace, stats_t *stats, speed_t *params)
+{
+    /* the heap of the per-object run just timed */
+    stats->heap_peak = mem_heapsize_peak();
+
+    arena_failed = 0;
+    params->trace = trace;
+    stats->arena_secs = fsecs(eval_arena_speed, params);
+    stats->arena_heap_peak = mem_heapsize_peak();
+    if (arena_failed)
+        stats->arena_secs = 0;
+}
+
+/*
+ * eval_arena_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the arena replay.
+ */
+static void eval_arena_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    mm_arena_t *arena;
+    mm_arena_scope_t scope;
+    int i, index, live = 0;
+    size_t size, oldsize;
+    char *p;
+
+    reinit_trace(trace);
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_arena_speed");
+    if ((arena = mm_arena_create()) == NULL)
+        app_error("mm_arena_create failed in eval_arena_speed");
+
+    for (i = 0; i < trace->num_ops && !arena_failed; i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_arena_malloc */
+        case CALLOC: /* mm_arena_malloc, the chunks aren't zero */
+        case REALLOC: /* mm_arena_malloc and copy */
+            p = trace->blocks[index];
+            if (p == NULL && live++ == 0)
+                scope = mm_arena_enter(arena);
+            if ((trace->blocks[index] = mm_arena_malloc(arena, size)) == NULL
+                && size != 0) {
+                arena_failed = 1;
+                break;
+            }
+            if (p != NULL) {
+                oldsize = trace->block_sizes[index];
+                memcpy(trace->blocks[index], p,
+                       oldsize < size ? oldsize : size);
+            }
+            trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* the end of the request, if it was its last block */
+            if (index < 0 || trace->blocks[index] == NULL)
+                break;
+            trace->blocks[index] = NULL;
+            if (--live == 0)
+                mm_arena_leave(arena, scope);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_arena_speed");
+        }
+    }
+
+    mm_arena_destroy(arena);
+}
+
+/*
+ * The latency mode (-L) : every request is timed with rdtsc.
+ *
+ * The trace is replayed LATENCY_RUNS times and each request keeps its
+ * fastest time, so an interrupt during one run doesn't make a request
+ * look slow, while a long search in the allocator still does.
+ * The requests are grouped by type and by the size they ask for
+ * (or, for free, the size of their block).
+ */
+#define LATENCY_RUNS    3
+#define LATENCY_CLASSES 5
+
+static const size_t latency_class_max[LATENCY_CLASSES] = {
+    64, 512, 4096, 32768, (size_t)-1
+};
+static const char *latency_class_name[LATENCY_CLASSES] = {
+    "<=64", "<=512", "<=4K", "<=32K", ">32K"
+};
+static const char *latency_op_name[] = { "malloc", "free", "realloc",
+                                          "calloc" };
+
+static unsigned long long *latency_sorted; /* for cmp_latency_index */
+
+static inline unsigned long long read_tsc(void)
+{
+    unsigned hi, lo;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* slowest first */
+static int cmp_latency_index(const void *a, const void *b)
+{
+    return cmp_latency(&latency_sorted[*(const int *)b],
+                       &latency_sorted[*(const int *)a]);
+}
+
+static int latency_class(size_t size)
+{
+    int c;
+
+    for (c = 0; size > latency_class_max[c]; c++)
+        ;
+    return c;
+}
+
+/*
+ * print_latency_row - p50, p99 and max of the requests of one type,
+ *                     and of one size class unless cls is -1
+ */
+static void print_latency_row(const trace_t *trace,
+                              const unsigned long long *cycles,
+                              const size_t *sizes,
+                              unsigned long long *buf, int type, int cls)
+{
+    int i, n = 0;
+
+    for (i = 0; i < trace->num_ops; i++)
+        if ((int)trace->ops[i].type == type &&
+            (cls < 0 || latency_class(sizes[i]) == cls))
+            buf[n++] = cycles[i];
+    if (n == 0)
+        return;
+
+    qsort(buf, n, sizeof(*buf), cmp_latency);
+    printf("  %-8s%-7s%9d%9llu%9llu%10llu\n", latency_op_name[type],
+           cls < 0 ? "all" : latency_class_name[cls], n,
+           buf[(n - 1) / 2], buf[(n - 1) * 99 / 100], buf[n - 1]);
+}
+
+/*
+ * eval_mm_latency - time every request of a trace, print the percentiles
+ *                   and the latency_top slowest requests
+ */
+static void eval_mm_latency(trace_t *trace)
+{
+    unsigned long long *cycles, *buf, t;
+    size_t *sizes;
+    int *order;
+    int run, i, index, type, cls;
+    char *p;
+
+    if ((cycles = malloc(trace->num_ops * sizeof(*cycles))) == NULL ||
+        (buf = malloc(trace->num_ops * sizeof(*buf))) == NULL ||
+        (sizes = calloc(trace->num_ops, sizeof(*sizes))) == NULL ||
+        (order = malloc(trace->num_ops * sizeof(*order))) == NULL)
+        unix_error("malloc failed in eval_mm_latency");
+    memset(cycles, 0xff, trace->num_ops * sizeof(*cycles));
+
+    for (run = 0; run < LATENCY_RUNS; run++) {
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in eval_mm_latency");
+
+        for (i = 0; i < trace->num_ops; i++) {
+            index = trace->ops[i].index;
+            switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+            case CALLOC: /* mm_calloc */
+                t = read_tsc();
+                p = mm_malloc_op(trace, i, trace->ops[i].size);
+                t = read_tsc() - t;
+                if (p == NULL)
+                    app_error("mm_malloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = sizes[i] = trace->ops[i].size;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                t = read_tsc();
+                p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+                t = read_tsc() - t;
+                if (p == NULL && trace->ops[i].size != 0)
+                    app_error("mm_realloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = sizes[i] = trace->ops[i].size;
+                break;
+
+            case FREE: /* mm_free */
+                p = index < 0 ? NULL : trace->blocks[index];
+                sizes[i] = index < 0 ? 0 : trace->block_sizes[index];
+                t = read_tsc();
+                mm_free(p);
+                t = read_tsc() - t;
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_latency");
+            }
+            if (t < cycles[i])
+                cycles[i] = t;
+        }
+    }
+
+    printf("\nLatency of %s in cycles, fastest of %d runs:\n",
+           trace->filename, LATENCY_RUNS);
+    printf("  %-8s%-7s%9s%9s%9s%10s\n",
+           "op", "size", "count", "p50", "p99", "max");
+    for (type = ALLOC; type <= CALLOC; type++) {
+        print_latency_row(trace, cycles, sizes, buf, type, -1);
+        for (cls = 0; cls < LATENCY_CLASSES; cls++)
+            print_latency_row(trace, cycles, sizes, buf, type, cls);
+    }
+
+    if (latency_top > 0) {
+        for (i = 0; i < trace->num_ops; i++)
+            order[i] = i;
+        latency_sorted = cycles;
+        qsort(order, trace->num_ops, sizeof(*order), cmp_latency_index);
+
+        printf("  slowest requests:\n");
+        printf("  %8s%6s %-8s%10s%10s\n",
+               "request", "line", "op", "size", "cycles");
+        for (i = 0; i < latency_top && i < trace->num_ops; i++) {
+            int op = order[i];
+            printf("  %8d%6d %-8s%10zu%10llu\n", op, LINENUM(op),
+                   latency_op_name[trace->ops[op].type], sizes[op],
+                   cycles[op]);
+        }
+    }
+
+    free(cycles);
+    free(buf);
+    free(sizes);
+    free(order);
+}
+
+#ifdef THREAD_SAFE
+/*
+ * mt_stamp - The byte a thread writes at both ends of its blocks
+ */
+static unsigned char mt_stamp(int id, int index)
+{
+    return (unsigned char)(id * 31 + index);
+}
+
+/*
+ * mt_check - Check that a block of this thread still has its stamps
+ */
+static int mt_check(mt_worker_t *w, int index)
+{
+    char *p = w->blocks[index];
+    size_t size = w->block_sizes[index];
+    unsigned char stamp = mt_stamp(w->id, index);
+
+    if (p == NULL || size == 0)
+        return 1;
+    return (unsigned char)p[0] == stamp &&
+        (unsigned char)p[size - 1] == stamp;
+}
+
+static void mt_set(mt_worker_t *w, int index, char *p, size_t size)
+{
+    w->blocks[index] = p;
+    w->block_sizes[index] = size;
+    if (p != NULL && size > 0)
+        p[0] = p[size - 1] = mt_stamp(w->id, index);
+}
+
+/*
+ * eval_mm_thread - One thread of the multithreaded mode. Replays the
+ *    whole trace on its own blocks, checking that no other thread
+ *    wrote into them.
+ */
+static void *eval_mm_thread(void *arg)
+{
+    mt_worker_t *w = arg;
+    trace_t *trace = w->trace;
+    int i, index;
+    size_t size;
+    char *p;
+
+    pthread_barrier_wait(w->start);
+    clock_gettime(CLOCK_MONOTONIC, &w->begin);
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+            if ((p = mm_malloc_op(trace, i, size)) == NULL || !IS_ALIGNED(p))
+                w->errors++;
+            mt_set(w, index, p, size);
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = w->blocks[index];
+            if (p != NULL && size > 0 && w->block_sizes[index] > 0 &&
+                (unsigned char)p[0] != mt_stamp(w->id, index))
+                w->errors++;
+            if ((p = mm_realloc(p, size)) == NULL && size != 0)
+                w->errors++;
+            if (p != NULL && size > 0 && w->block_sizes[index] > 0 &&
+                (unsigned char)p[0] != mt_stamp(w->id, index))
+                w->errors++;
+            mt_set(w, index, p, size);
+            break;
+
+        case FREE: /* mm_free */
+            if (index < 0) {
+                mm_free(NULL);
+                break;
+            }
+            if (!mt_check(w, index))
+                w->errors++;
+            mm_free(w->blocks[index]);
+            w->blocks[index] = NULL;
+            w->block_sizes[index] = 0;
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_thread");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w->end);
+    return NULL;
+}
+
+static double mt_secs(struct timespec *t)
+{
+    return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+/*
+ * eval_mm_mt - Replay a trace in n threads at once on a fresh heap,
+ *    return the wall time from the first start to the last finish,
+ *    or -1 if a thread found an error.
+ */
+static double eval_mm_mt(trace_t *trace, int n)
+{
+    pthread_t tid[n];
+    mt_worker_t workers[n];
+    pthread_barrier_t start;
+    double begin = 0, end = 0;
+    int i, errs = 0;
+
+    if (mem_init() < 0)
+        unix_error("mem_init failed");
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_mt");
+
+    pthread_barrier_init(&start, NULL, n + 1);
+    for (i = 0; i < n; i++) {
+        workers[i].trace = trace;
+        workers[i].start = &start;
+        workers[i].id = i;
+        workers[i].errors = 0;
+        if ((workers[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL ||
+            (workers[i].block_sizes = calloc(trace->num_ids, sizeof(size_t))) == NULL)
+            unix_error("calloc failed in eval_mm_mt");
+        if (pthread_create(&tid[i], NULL, eval_mm_thread, &workers[i]) != 0)
+            unix_error("pthread_create failed in eval_mm_mt");
+    }
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < n; i++)
+        pthread_join(tid[i], NULL);
+
+    for (i = 0; i < n; i++) {
+        if (i == 0 || mt_secs(&workers[i].begin) < begin)
+            begin = mt_secs(&workers[i].begin);
+        if (i == 0 || mt_secs(&workers[i].end) > end)
+            end = mt_secs(&workers[i].end);
+        errs += workers[i].errors;
+        free(workers[i].blocks);
+        free(workers[i].block_sizes);
+    }
+    pthread_barrier_destroy(&start);
+    mem_deinit();
+
+    if (errs) {
+        printf("ERROR [trace %s, %d threads]: %d blocks allocated or "
+               "overwritten wrongly\n", trace->filename, n, errs);
+        errors += errs;
+        return -1;
+    }
+    return end - begin;
+}
+
+/*
+ * run_mt_tests - The multithreaded mode (-T n). Every trace is replayed
+ *    by 1, 2, 4, ... n threads at once, each on its own blocks, and the
+ *    aggregate throughput is reported for each thread count, best of 3.
+ *    Traces that only count for utilization are skipped.
+ */
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles)
+{
+    int counts[32], num_counts = 0;
+    double total_ops[32] = {0}, total_secs[32] = {0};
+    stats_t stats;
+    int i, j, k, n;
+
+    for (n = 1; n < mt_threads; n *= 2)
+        counts[num_counts++] = n;
+    counts[num_counts++] = mt_threads;
+
+    printf("\nResults for mm malloc, Kops by number of threads:\n");
+    printf("  %-32s", "trace");
+    for (j = 0; j < num_counts; j++)
+        printf("%9d", counts[j]);
+    printf("\n");
+
+    for (i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(&stats, tracedir, tracefiles[i]);
+
+        if (trace->weight == WUTIL) {
+            free_trace(trace);
+            continue;
+        }
+
+        printf("  %-32s", tracefiles[i]);
+        for (j = 0; j < num_counts; j++) {
+            double secs = -1, t;
+
+            for (k = 0; k < 3; k++) {
+                if ((t = eval_mm_mt(trace, counts[j])) < 0) {
+                    secs = -1;
+                    break;
+                }
+                if (secs < 0 || t < secs)
+                    secs = t;
+            }
+            if (secs <= 0) {
+                printf("%9s", "-");
+                continue;
+            }
+            printf("%9.0f", counts[j] * trace->num_ops / secs / 1e3);
+            total_ops[j] += counts[j] * trace->num_ops;
+            total_secs[j] += secs;
+        }
+        printf("\n");
+        free_trace(trace);
+    }
+
+    printf("  %-32s", "total");
+    for (j = 0; j < num_counts; j++)
+        printf("%9.0f", total_secs[j] > 0 ? total_ops[j] / total_secs[j] / 1e3 : 0);
+    printf("\n  %-32s", "speedup");
+    for (j = 0; j < num_counts; j++)
+        printf("%8.2fx", total_secs[j] > 0 && total_secs[0] > 0 ?
+               (total_ops[j] / total_secs[j]) / (total_ops[0] / total_secs[0]) : 0);
+    printf("\n");
+
+    if (errors)
+        printf("Terminated with %d errors\n", errors);
+}
+#endif
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1172,7 +2336,8 @@ static int eval_libc_valid(trace_t *trace)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL) {
+        case CALLOC: /* calloc */
+            if ((p = libc_malloc_op(trace, i, trace->ops[i].size)) == NULL) {
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
             }
@@ -1222,9 +2387,10 @@ static void eval_libc_speed(void *ptr)
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case CALLOC: /* calloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
+            if ((p = libc_malloc_op(trace, i, size)) == NULL)
                 unix_error("malloc failed in eval_libc_speed");
             trace->blocks[index] = p;
             break;
@@ -1275,8 +2441,9 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     char wstr;
 
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s %5s%8s%9s%8s%8s  %s\n",
+           "valid", "util", "ops", "secs", "Kops", "peakKB", "finalKB",
+           "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1318,6 +2485,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            /* resident size of the heap, measured with the validity */
+            if (stats[i].rss_peak)
+                printf("%8zu%8zu", stats[i].rss_peak >> 10,
+                       stats[i].rss_final >> 10);
+            else
+                printf("%8s%8s", "--", "--");
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1333,13 +2507,15 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                 }
         }
         else {
-            printf("%2s%4s %6s%8s%10s%6s %s\n",
+            printf("%2s%4s %6s%8s%10s%6s%8s%8s %s\n",
                    stats[i].weight != 0 ? "*" : "",
                    "no",
                    "-",
                    "-",
                    "-",
                    "-",
+                   "-",
+                   "-",
                    stats[i].filename);
         }
     }
@@ -1383,6 +2559,64 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * print_counters - print the hardware events of the timed run of each
+ *     valid trace: IPC, then misses per request ('--' if not counted)
+ */
+static void print_counters(int n, stats_t *stats)
+{
+    static const int misses[] = { FCYC_L1D_MISSES, FCYC_LLC_MISSES,
+                                  FCYC_DTLB_MISSES, FCYC_BRANCH_MISSES };
+    int i, j;
+
+    printf("Hardware events per request:\n");
+    printf("%6s%6s%8s%8s%8s%8s  %s\n",
+           "Kops", "IPC", "L1D", "LLC", "dTLB", "branch", "trace");
+    for (i = 0; i < n; i++) {
+        const double *c = stats[i].counts;
+
+        if (!stats[i].valid)
+            continue;
+
+        printf("%6.0f", (stats[i].ops/1e3)/stats[i].secs);
+        if (c[FCYC_CYCLES] > 0 && c[FCYC_INSTRUCTIONS] >= 0)
+            printf("%6.2f", c[FCYC_INSTRUCTIONS] / c[FCYC_CYCLES]);
+        else
+            printf("%6s", "--");
+        for (j = 0; j < (int)(sizeof(misses) / sizeof(misses[0])); j++) {
+            if (c[misses[j]] >= 0)
+                printf("%8.3f", c[misses[j]] / stats[i].ops);
+            else
+                printf("%8s", "--");
+        }
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
+/*
+ * print_arena - Compare the arena replay (-R) with mm_malloc and mm_free.
+ */
+static void print_arena(int n, stats_t *stats)
+{
+    int i;
+
+    printf("Arena replay, freed as each request ends:\n");
+    printf("%8s%8s%10s%10s  %s\n",
+           "Kops", "arena", "heapKB", "arenaKB", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+
+        printf("%8.0f", (stats[i].ops/1e3)/stats[i].secs);
+        if (stats[i].arena_secs > 0)
+            printf("%8.0f%10zu%10zu", (stats[i].ops/1e3)/stats[i].arena_secs,
+                   stats[i].heap_peak >> 10, stats[i].arena_heap_peak >> 10);
+        else
+            printf("%8s%10zu%10s", "--", stats[i].heap_peak >> 10, "--");
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1441,4 +2675,14 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-j <n>     Check up to n traces at once, in worker processes.\n");
+    fprintf(stderr, "\t-b <dir>   Save the traces in <dir> in the binary format, and exit.\n");
+    fprintf(stderr, "\t-L <n>     Report the latency of each request, list the n slowest.\n");
+    fprintf(stderr, "\t-P         Count hardware events of the timed runs (Linux).\n");
+    fprintf(stderr, "\t-H <n>     Hint blocks freed within n requests as short-lived.\n");
+    fprintf(stderr, "\t-R         Replay the traces on an arena too, freed as each request ends.\n");
+    fprintf(stderr, "\t-F <file>  Write the heap shape during each trace to <file> (JSON lines).\n");
+#ifdef THREAD_SAFE
+    fprintf(stderr, "\t-T <n>     Replay each trace in 1..n threads, report scaling.\n");
+#endif
 }
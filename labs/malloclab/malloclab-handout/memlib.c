@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,8 +11,10 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <unistd.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "memlib.h"
 #include "config.h"
@@ -20,20 +23,65 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *mem_brk_peak;			/* high water mark of mem_brk */
+static char *mem_zero;				/* the heap reads as zero from here up */
+
+/* regions mapped outside the heap, for the largest blocks */
+typedef struct mem_region {
+	char *lo;
+	size_t size;
+	struct mem_region *next;
+} mem_region_t;
+
+static mem_region_t *regions;
+static size_t mapped_bytes;		/* bytes mapped right now */
+static size_t mapped_peak;		/* high water mark of mapped_bytes */
+
+#ifdef THREAD_SAFE
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+#define REGIONS_LOCK()		pthread_mutex_lock(&regions_lock)
+#define REGIONS_UNLOCK()	pthread_mutex_unlock(&regions_lock)
+#else
+#define REGIONS_LOCK()
+#define REGIONS_UNLOCK()
+#endif
+
+/*
+ * Inside a real program (libmm.so) errno alone reports a failure, and the
+ * process break is left to the program: only the driver prints, and only
+ * the driver calls sbrk() to give mem_sbrk the semantics of a real one.
+ */
+#ifdef LIBMM
+#define mem_error(msg)
+#define os_sbrk_fails(incr)	0
+#else
+#define mem_error(msg)		fprintf(stderr, "ERROR: " msg "\n")
+#define os_sbrk_fails(incr)	((incr) > 0 && sbrk(incr) == (void *) -1)
+#endif
+
+static void mem_unmap_all(void);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. Returns 0, or -1 with
+ *		errno set when the heap cannot be mapped.
  */
-void mem_init(void){
-	int dev_zero = open("/dev/zero", O_RDWR);
+int mem_init(void){
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
-			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
-			dev_zero,				/* fd */
-			0);						/* offset (dunno) */
+			PROT_READ | PROT_WRITE,	/* permissions */
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* no swap reserved */
+			-1,						/* fd */
+			0);						/* offset */
+	if (heap == MAP_FAILED) {
+		heap = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_brk_peak = heap;
+	mem_zero = heap;
+	return 0;
 }
 
 /* 
@@ -41,6 +89,7 @@ void mem_init(void){
  */
 void mem_deinit(void){
 	munmap(heap, MAX_HEAP);
+	mem_unmap_all();
 }
 
 /*
@@ -48,28 +97,69 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	mem_brk_peak = heap;
+	mem_unmap_all();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap, and the pages above the new brk
+ *		are given back to the OS.
  */
 void *mem_sbrk(int incr) {
 	char *old_brk = mem_brk;
 
+	if (incr < 0 && mem_brk + incr < heap) {
+		errno = EINVAL;
+		mem_error("mem_sbrk failed. Shrunk below the heap...");
+		return (void *)-1;
+	}
+
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+    // (never to shrink: the process brk is the C library's heap too)
+	if ( ((mem_brk + incr) > mem_max_addr) ||
+            os_sbrk_fails(incr)) {
 		errno = ENOMEM;
-		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+		mem_error("mem_sbrk failed. Ran out of memory...");
 		return (void *)-1;
 	}
 
 	mem_brk += incr;
+	if (incr < 0)
+		mem_release(mem_brk, mem_zero - mem_brk);
+	else if (mem_brk > mem_zero)
+		mem_zero = (char *)(((size_t)mem_brk + mem_pagesize() - 1)
+			& ~(mem_pagesize() - 1));
+	if (mem_brk > mem_brk_peak)
+		mem_brk_peak = mem_brk;
 	return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the whole pages of [lo, lo + size) back to the OS,
+ *		like madvise(MADV_DONTNEED). They read as zero when touched again.
+ */
+void mem_release(void *lo, size_t size) {
+	size_t page = mem_pagesize();
+	char *begin = (char *)(((size_t)lo + page - 1) & ~(page - 1));
+	char *end = (char *)(((size_t)lo + size) & ~(page - 1));
+
+	if (begin < end)
+		madvise(begin, end - begin, MADV_DONTNEED);
+	if (begin >= mem_brk && begin < mem_zero && end >= mem_zero)
+		mem_zero = begin;
+}
+
+/*
+ * mem_heap_zero - return the address from which the heap reads as zero:
+ *		the pages above it were never below the brk, or were released
+ *		since. (page aligned)
+ */
+void *mem_heap_zero(){
+	return (void *)mem_zero;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -91,9 +181,227 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_heapsize_peak() - returns the largest heap size since the last reset
+ */
+size_t mem_heapsize_peak() {
+	return (size_t)((void *)mem_brk_peak - (void *)heap);
+}
+
+/*
+ * mem_resident - the bytes of [lo, lo + size) resident in memory
+ */
+static size_t mem_resident(char *lo, size_t size) {
+	size_t page = mem_pagesize();
+	size_t n = (size + page - 1) / page, i, resident = 0;
+	unsigned char vec[1024];
+
+	for (i = 0; i < n; i += sizeof(vec)) {
+		size_t m = n - i < sizeof(vec) ? n - i : sizeof(vec);
+		size_t j;
+
+		if (mincore(lo + i * page, m * page, vec) < 0)
+			return 0;
+		for (j = 0; j < m; j++)
+			resident += vec[j] & 1;
+	}
+	return resident * page;
+}
+
+/*
+ * mem_rss() - returns the bytes of the heap and of the mapped regions
+ *		resident in memory
+ */
+size_t mem_rss() {
+	mem_region_t *r;
+	size_t rss = mem_resident(heap, mem_brk - heap);
+
+	REGIONS_LOCK();
+	for (r = regions; r != NULL; r = r->next)
+		rss += mem_resident(r->lo, r->size);
+	REGIONS_UNLOCK();
+	return rss;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/*
+ * mem_round_pages - round size up to a multiple of the page size
+ */
+static size_t mem_round_pages(size_t size) {
+	size_t page = mem_pagesize();
+	return (size + page - 1) & ~(page - 1);
+}
+
+/*
+ * mem_find_region - the region holding address p, or NULL
+ */
+static mem_region_t *mem_find_region(const void *p) {
+	mem_region_t *r;
+
+	for (r = regions; r != NULL; r = r->next)
+		if ((char *)p >= r->lo && (char *)p < r->lo + r->size)
+			return r;
+	return NULL;
+}
+
+/*
+ * mem_region_alloc - a record for a new region, taken from pages of its
+ *		own rather than from malloc, which may be the package under test
+ *		(e.g. in libmm.so). Called with the regions locked.
+ */
+static mem_region_t *region_free_list;
+
+static mem_region_t *mem_region_alloc(void) {
+	mem_region_t *r;
+	size_t i, n;
+
+	if (region_free_list == NULL) {
+		n = mem_pagesize() / sizeof(mem_region_t);
+		r = mmap(NULL, mem_pagesize(), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (r == MAP_FAILED)
+			return NULL;
+		for (i = 0; i < n; i++) {
+			r[i].next = region_free_list;
+			region_free_list = &r[i];
+		}
+	}
+	r = region_free_list;
+	region_free_list = r->next;
+	return r;
+}
+
+static void mem_region_free(mem_region_t *r) {
+	r->next = region_free_list;
+	region_free_list = r;
+}
+
+/*
+ * mem_map - map a region of at least size bytes outside the heap, like
+ *		mmap(2). Returns its page-aligned start, or (void *)-1.
+ */
+void *mem_map(size_t size) {
+	mem_region_t *r;
+	char *lo;
+
+	size = mem_round_pages(size);
+	lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	REGIONS_LOCK();
+	if (lo == MAP_FAILED || (r = mem_region_alloc()) == NULL) {
+		REGIONS_UNLOCK();
+		if (lo != MAP_FAILED)
+			munmap(lo, size);
+		errno = ENOMEM;
+		mem_error("mem_map failed. Ran out of memory...");
+		return (void *)-1;
+	}
+
+	r->lo = lo;
+	r->size = size;
+	r->next = regions;
+	regions = r;
+	mapped_bytes += size;
+	if (mapped_bytes > mapped_peak)
+		mapped_peak = mapped_bytes;
+	REGIONS_UNLOCK();
+	return lo;
+}
+
+/*
+ * mem_remap - resize a region returned by mem_map, moving it if needed,
+ *		like mremap(2). Returns the new start, or (void *)-1.
+ */
+void *mem_remap(void *lo, size_t size) {
+	mem_region_t *r;
+	char *new_lo;
+
+	size = mem_round_pages(size);
+	REGIONS_LOCK();
+	if ((r = mem_find_region(lo)) == NULL ||
+			(new_lo = mremap(r->lo, r->size, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+		REGIONS_UNLOCK();
+		errno = ENOMEM;
+		mem_error("mem_remap failed.");
+		return (void *)-1;
+	}
+	mapped_bytes += size - r->size;
+	if (mapped_bytes > mapped_peak)
+		mapped_peak = mapped_bytes;
+	r->lo = new_lo;
+	r->size = size;
+	REGIONS_UNLOCK();
+	return new_lo;
+}
+
+/*
+ * mem_unmap - release a region returned by mem_map
+ */
+void mem_unmap(void *lo) {
+	mem_region_t **pr, *r;
+
+	REGIONS_LOCK();
+	for (pr = &regions; (r = *pr) != NULL; pr = &r->next) {
+		if (r->lo == lo) {
+			*pr = r->next;
+			munmap(r->lo, r->size);
+			mapped_bytes -= r->size;
+			mem_region_free(r);
+			break;
+		}
+	}
+	REGIONS_UNLOCK();
+}
+
+/*
+ * mem_unmap_all - release every mapped region and reset the counters
+ */
+static void mem_unmap_all(void) {
+	mem_region_t *r;
+
+	REGIONS_LOCK();
+	while ((r = regions) != NULL) {
+		regions = r->next;
+		munmap(r->lo, r->size);
+		mem_region_free(r);
+	}
+	mapped_bytes = mapped_peak = 0;
+	REGIONS_UNLOCK();
+}
+
+/*
+ * mem_is_mapped - return whether p lies in a region returned by mem_map
+ */
+int mem_is_mapped(const void *p) {
+	int found;
+
+	REGIONS_LOCK();
+	found = mem_find_region(p) != NULL;
+	REGIONS_UNLOCK();
+	return found;
+}
+
+/*
+ * mem_lock, mem_unlock - hold the regions across a fork(), so the child
+ *		never inherits them locked by a thread it does not have
+ */
+void mem_lock(void) {
+	REGIONS_LOCK();
+}
+
+void mem_unlock(void) {
+	REGIONS_UNLOCK();
+}
+
+/*
+ * mem_mapped_peak - the most bytes mapped at once since the last reset
+ */
+size_t mem_mapped_peak(void) {
+	return mapped_peak;
+}
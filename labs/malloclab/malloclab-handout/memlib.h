@@ -1,11 +1,23 @@
 #include <unistd.h>
 
-void mem_init(void);               
+int mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_zero(void);
 size_t mem_heapsize(void);
+size_t mem_heapsize_peak(void);
 size_t mem_pagesize(void);
+void mem_release(void *lo, size_t size);
+size_t mem_rss(void);
+
+void *mem_map(size_t size);
+void *mem_remap(void *lo, size_t size);
+void mem_unmap(void *lo);
+int mem_is_mapped(const void *p);
+size_t mem_mapped_peak(void);
+void mem_lock(void);
+void mem_unlock(void);
 
@@ -70,11 +70,23 @@
  *          I used a small array to maintain those free and allocated blocks.
  *
  *              For malloc:
- *                  we could search them in this array.
+ *                  take the lowest free slot of its bitmap.
  *
  *              For free:
  *                  we could find them by the given address.
  *
+ *          Or, with SLAB_ALLOCATOR, (size <= SLAB_MAX_SIZE, header included)
+ *          I used slabs to maintain those allocated blocks.
+ *          A slab is an ordinary allocated block of the heap, cut into
+ *          objects of one size class, with a bitmap of its free objects.
+ *
+ *              For malloc:
+ *                  take the lowest free object of the first partial slab.
+ *
+ *              For free:
+ *                  the object header tells its slab and its index.
+ *                  An empty slab goes back to the heap.
+ *
  *
  *      + LIMIT_1 < size <= LIMIT_2
  *          
@@ -84,6 +96,21 @@
  *      + size > LIMIT_2
  *          I used treap to maintain those free blocks.
  *
+ *          Not a single treap, but one per TLSF-style size class:
+ *          the class is the highest bit of the size and the next
+ *          BST_SL_BITS bits below it.
+ *
+ *
+ *      + size >= MMAP_THRESHOLD
+ *          Not in the heap at all : every such block is a region of its own,
+ *          mapped by mem_map and given back by mem_unmap on free.
+ *          (see malloc_mapped)
+ *
+ *
+ * Both the linked lists and the treaps are indexed by occupancy bitmaps,
+ * so the first non-empty class that could fit a request is found with
+ * one or two ctz instructions instead of a scan.
+ *
  *
  *
  *
@@ -134,8 +161,17 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#ifdef HARDENED
+#include <time.h>
+#endif
+
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
@@ -154,8 +190,27 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define malloc_hint mm_malloc_hint
 #endif /* def DRIVER */
 
+/*
+ * LIBMM (set by the Makefile for libmm.so) :
+ *      the same aliases, the functions of the C library are defined at
+ *      the end of this file on top of them.
+ */
+#ifdef LIBMM
+#ifndef THREAD_SAFE
+#error "libmm.so needs THREAD_SAFE"
+#endif
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#define memalign mm_memalign
+#define malloc_hint mm_malloc_hint
+#endif /* def LIBMM */
+
 /* single word (4) or double word (8) alignment */
 #define ALIGNMENT 8
 
@@ -167,14 +222,78 @@ static int in_heap(const void *p);
 
 
 
-#define DEADBEEF    0xdeadbeef
-#define DEADBEEFx2  (long)0xdeadbeefdeadbeef
-
 #define HEADER_SIZE     4
 
+/*
+ * the canary at the end of an allocated block (HARDENED),
+ *      BLOCK_OVERHEAD is what a block holds besides its payload.
+ */
+#ifdef HARDENED
+#define CANARY_SIZE     4
+#else
+#define CANARY_SIZE     0
+#endif
+#define BLOCK_OVERHEAD  (HEADER_SIZE + CANARY_SIZE)
+
+/*
+ * SLAB_ALLOCATOR (set by the Makefile for mdriver-slab) :
+ *      serve the small blocks from slabs instead of the 8-byte array.
+ *
+ *      O(1) for malloc and free, but a partial slab keeps its free objects
+ *      from being coalesced: 92 points instead of 99 on the default traces.
+ */
+
+/*
+ * HARDENED (set by the Makefile for mdriver-hardened and libmm-hardened.so) :
+ *      check the heap metadata on the way, and abort on a corrupted heap
+ *      instead of handing out a block twice. (see check_allocated_block)
+ *
+ *      + the links of the free blocks are xor'ed with a key drawn by mm_init,
+ *        a decoded link must be NIL or an offset inside the heap.
+ *      + the last word of an allocated block is a canary,
+ *        free tells a live block from a freed or an overrun one by it.
+ *      + a freed block waits in a quarantine, until QUARANTINE_BYTES
+ *        bytes (or QUARANTINE_SIZE blocks) were freed after it,
+ *        before the heap may hand it out again.
+ *
+ * A slab object or an 8-byte slot has no room for a canary,
+ * so neither is used by the hardened build.
+ */
+#if defined(HARDENED) && defined(SLAB_ALLOCATOR)
+#error "HARDENED has no canary in the slab objects"
+#endif
+
+/*
+ * THREAD_SAFE (set by the Makefile for mdriver-mt) :
+ *      the heap is guarded by one lock, and every thread keeps a cache
+ *      of small blocks in front of it. (see tcache_malloc)
+ *
+ * The 8-byte array has no lock and its slots no canary,
+ * so it is only used by the single-threaded build without slabs.
+ * (nor by the hardened one)
+ */
+#if !defined(SLAB_ALLOCATOR) && !defined(THREAD_SAFE) && !defined(HARDENED)
+#define BYTE_8_ARRAY
+#endif
+
 #define LINKED_LIST_SIZE 10
 #define LINKED_LIST_MAX_BLOCK_SIZE ((LINKED_LIST_SIZE + 1) << 3)
 
+/*
+ * Blocks of at least MMAP_THRESHOLD bytes are mapped outside the heap.
+ *
+ * The 4-byte header of a heap block and the int offsets from heap_pool
+ * limit the heap to 2GB, so only mapped blocks may be larger: their size
+ * is a size_t, kept at the start of the region.
+ *
+ *      [ block size (8) | offset (4) | BLOCK_MAPPED (4) | payload ... ]
+ *
+ * offset : from the start of the region to the block size,
+ *          0 unless the payload was moved up for memalign.
+ */
+#define MMAP_THRESHOLD      (1 << 20)
+#define MAPPED_HEADER_SIZE  16
+
 
 
 static void Display_bst();
@@ -207,16 +326,31 @@ static inline int *linkedlist_prev(void *header);
 
 static inline int previous_block_is_free(void *ptr);
 static inline int get_previous_free_block_size(void *header);
-static inline unsigned short get_allocated_block_size(void *ptr);
+static inline int get_allocated_block_size(void *ptr);
 
 
 static void *heap_pool;
 
+#ifdef THREAD_SAFE
+/*
+ * bumped by mm_init, a thread cache of an older epoch belongs to an old heap.
+ */
+static int arena_epoch;
+#endif
+
+
 
+static void *slab_malloc(int size);
+static void slab_free(void *header);
+static void nursery_free(void *header);
+static void *malloc_block(size_t size);
 
-#define STACK_SIZE      32
+#ifdef BYTE_8_ARRAY
+#define STACK_SIZE      32  /* at most 32 slots, ptr_8_free is one word */
 
 static void *ptr_8_begin, *ptr_8_end;
+static unsigned ptr_8_free;     /* bit k is set if slot k is free */
+#endif
 
 
 
@@ -231,7 +365,161 @@ static inline int get_linkedlist_head_index(int size)
 }
 
 
-static int bstro;
+/*
+ * TLSF-style classes of the treap blocks.
+ *
+ *      first level  : fl = highest set bit of the size  (BST_FL_MIN .. 31)
+ *      second level : sl = the BST_SL_BITS bits below it
+ *
+ * Every class has its own treap, and the best fit of a class is also the
+ * best fit of the whole heap if no smaller class could hold the request.
+ */
+#define BST_SL_BITS     3
+#define BST_SL_COUNT    (1 << BST_SL_BITS)
+#define BST_FL_MIN      6
+#define BST_FL_COUNT    (32 - BST_FL_MIN)
+#define BST_CLASS_COUNT (BST_FL_COUNT * BST_SL_COUNT)
+
+/*
+ * roots of the treaps and the second level bitmaps.
+ * (kept together like <tpool>, there is no global array)
+ */
+struct TClass
+{
+    int root[BST_CLASS_COUNT];
+    unsigned sl_bitmap[BST_FL_COUNT];
+} tclass;
+
+static int *bstro;
+
+static int *linkedlist_pool;
+
+/*
+ * bit fl is set if any class of that first level is non-empty.
+ */
+static unsigned bst_fl_bitmap;
+
+/*
+ * bit i is set if linkedlist_pool[i] is not empty.
+ */
+static unsigned linkedlist_bitmap;
+
+
+/*
+ * size classes of the slabs (see slab_malloc),
+ *      one per 8 bytes up to SLAB_MAX_SIZE.
+ */
+#define SLAB_MAX_SIZE     128
+#define SLAB_CLASS_COUNT  (SLAB_MAX_SIZE >> 3)
+#define SLAB_META_SIZE    16
+
+/*
+ * objects in a slab. (at most 32, the bitmap is a single word)
+ *
+ * the more objects, the less often a slab is built or returned,
+ * but the more memory a nearly empty slab holds.
+ * So a new slab holds as many objects as the class has in use.
+ */
+#define SLAB_MIN_OBJECTS  8
+#define SLAB_MAX_OBJECTS  32
+
+struct TSlab
+{
+    int partial[SLAB_CLASS_COUNT];
+    int used[SLAB_CLASS_COUNT];
+} tslab;
+
+
+/*
+ * nursery of the short-lived blocks (see malloc_hint),
+ *      each lifetime class bumps its objects out of a chunk of its own.
+ *
+ * a chunk is an allocated block of the heap, freed as a whole with its
+ * last object, so the short-lived blocks leave no holes between the
+ * long-lived ones; a chunk that fills up gives way to one twice as large.
+ *
+ * NURSERY_OBJECT tells an object header from a slab object's: the size
+ * of a slab object (< 256) is all it has below bit 16.
+ */
+#define NURSERY_OBJECT     0x8000
+#define NURSERY_META_SIZE  16
+#define NURSERY_MAX_SIZE   240
+#define NURSERY_MIN_CHUNK  256
+#define NURSERY_MAX_CHUNK  (64 << 10)
+#define NURSERY_CHUNK_SHIFT 4
+
+#if SLAB_MAX_SIZE >= 256 || NURSERY_MAX_SIZE >= 1024
+#error "a slab object header would read as a nursery object"
+#endif
+
+struct TNursery
+{
+    int chunk[MM_LIFETIMES];    /* the chunk objects are bumped from, or NIL */
+    int top[MM_LIFETIMES];      /* the header of its next object */
+} tnursery;
+
+
+/*
+ * map a free block size to its treap class.
+ *
+ * sizes below the first level share class 0.
+ */
+static inline int get_bst_class_index(int size)
+{
+    int fl = 31 - __builtin_clz(size);
+
+    if (fl < BST_FL_MIN)
+        return 0;
+
+    int sl = (size >> (fl - BST_SL_BITS)) & (BST_SL_COUNT - 1);
+    return ((fl - BST_FL_MIN) << BST_SL_BITS) | sl;
+}
+
+static inline void bst_class_mark(int index)
+{
+    int fl = index >> BST_SL_BITS;
+
+    tclass.sl_bitmap[fl] |= 1u << (index & (BST_SL_COUNT - 1));
+    bst_fl_bitmap |= 1u << fl;
+}
+
+static inline void bst_class_unmark(int index)
+{
+    int fl = index >> BST_SL_BITS;
+
+    tclass.sl_bitmap[fl] &= ~(1u << (index & (BST_SL_COUNT - 1)));
+    if (tclass.sl_bitmap[fl] == 0)
+        bst_fl_bitmap &= ~(1u << fl);
+}
+
+/*
+ * the first non-empty class not smaller than <index>.
+ *
+ * return -1 if there isn't one.
+ */
+static inline int bst_class_next(int index)
+{
+    if (index >= BST_CLASS_COUNT)
+        return -1;
+
+    int fl = index >> BST_SL_BITS;
+    unsigned sl_map = tclass.sl_bitmap[fl]
+        & (~0u << (index & (BST_SL_COUNT - 1)));
+
+    if (sl_map == 0)
+    {
+        unsigned fl_map = fl + 1 < BST_FL_COUNT ?
+            bst_fl_bitmap & (~0u << (fl + 1)) : 0;
+
+        if (fl_map == 0)
+            return -1;
+
+        fl = __builtin_ctz(fl_map);
+        sl_map = tclass.sl_bitmap[fl];
+    }
+
+    return (fl << BST_SL_BITS) | __builtin_ctz(sl_map);
+}
 
 
 
@@ -308,6 +596,8 @@ static int too_much_external_fragmentation()
  */
 
 static void *virtual_brk;
+static void *heap_zero;     /* the heap reads as zero from here up (calloc) */
+static void *release_brk;   /* the highest virtual brk since the last sweep */
 
 
 #define ACTUAL_BRK (mem_heap_hi() + 1)
@@ -321,14 +611,24 @@ static inline void *mem_get_brk()
 #define INCREMENT    0x100
 #define VBRK_LIMIT   0x800010000
 
-static inline void mem_request(size_t size)
+/*
+ * move the virtual brk up by <size> bytes,
+ *      return -1 (and leave it) if memlib is out of memory.
+ */
+static inline int mem_request(size_t size)
 {
-    virtual_brk += size;
-    if (virtual_brk > ACTUAL_BRK)
-    {
-        mem_sbrk((virtual_brk - ACTUAL_BRK
-            + ((long)virtual_brk > VBRK_LIMIT) * INCREMENT));
-    }
+    void *brk = virtual_brk + size;
+
+    if (brk > ACTUAL_BRK && mem_sbrk((brk - ACTUAL_BRK
+            + ((long)brk > VBRK_LIMIT) * INCREMENT)) == (void *)-1)
+        return -1;
+
+    virtual_brk = brk;
+    if (virtual_brk > heap_zero)
+        heap_zero = virtual_brk;
+    if (virtual_brk > release_brk)
+        release_brk = virtual_brk;
+    return 0;
 }
 
 static inline void mem_shrink(void *ptr)
@@ -336,9 +636,151 @@ static inline void mem_shrink(void *ptr)
     virtual_brk = ptr;
 }
 
+/*
+ * Zero pages : the pages memlib has never handed out, or has given back
+ *      to the OS since, read as zero (mem_heap_zero), and so does the
+ *      heap above the highest virtual brk.
+ *      calloc does not clear a block from there up,
+ *      nor the pages released inside the heap. (see release_free_blocks)
+ */
 static inline void mem_init_virtual_brk()
 {
     virtual_brk = ACTUAL_BRK;
+    heap_zero = mem_heap_zero();
+    release_brk = virtual_brk;
+}
+
+/*
+ * released_pages : a bit for each page of the heap that was released
+ *      and has not been written since. (see release_free_blocks)
+ */
+#define RELEASE_PAGE_SHIFT  12
+#define RELEASE_PAGES       ((MAX_HEAP >> RELEASE_PAGE_SHIFT) + 2)
+#define FREE_BLOCK_META     32
+
+static unsigned released_pages[(RELEASE_PAGES + 31) / 32];
+static int released_any;        /* a bit may be set */
+static int release_clock, release_sweep;
+
+static inline size_t released_page_index(const void *p)
+{
+    return ((size_t)p >> RELEASE_PAGE_SHIFT)
+        - ((size_t)heap_pool >> RELEASE_PAGE_SHIFT);
+}
+
+static inline int page_is_released(size_t i)
+{
+    return released_pages[i / 32] >> (i % 32) & 1;
+}
+
+/*
+ * the pages over [lo, lo + size) are no longer zero.
+ */
+static inline void unmark_released(void *lo, int size)
+{
+    if (!released_any)
+        return;
+    for (size_t i = released_page_index(lo),
+            end = released_page_index(lo + size - 1); i <= end; ++i)
+        released_pages[i / 32] &= ~(1u << (i % 32));
+}
+
+static inline void released_init(void)
+{
+    if (released_any)
+        memset(released_pages, 0, sizeof(released_pages));
+    released_any = 0;
+    release_clock = 0;
+}
+
+
+
+
+
+
+
+
+
+
+/*
+ *
+ * Hardening. (with HARDENED)
+ *
+ *      link   : stored as link ^ link_key.
+ *      canary : the last word of an allocated block,
+ *               canary_key ^ a hash of its offset while it is allocated,
+ *               the complement of that once it is freed.
+ */
+#define QUARANTINE_SIZE     64
+#define QUARANTINE_BYTES    (4 << 10)
+
+#ifdef HARDENED
+struct THardened
+{
+    unsigned long link_key, canary_key; /* long : no int store aliases them */
+    int quarantine[QUARANTINE_SIZE];    /* payload offsets, oldest first */
+    int quarantine_head, quarantine_count;
+    int quarantine_bytes;               /* the size of the blocks in it */
+} thardened;
+
+/*
+ * draw the keys of a new heap, and empty the quarantine.
+ */
+static void hardened_init(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    unsigned seed = ts.tv_nsec ^ ts.tv_sec << 20 ^ getpid() << 8
+        ^ (unsigned)(size_t)&ts;
+
+    thardened.link_key = seed * 0x9e3779b1u;
+    thardened.canary_key = (seed ^ thardened.link_key >> 15) * 0x85ebca6bu;
+
+    thardened.quarantine_head = 0;
+    thardened.quarantine_count = 0;
+    thardened.quarantine_bytes = 0;
+}
+#endif
+
+static void heap_error(const char *msg, const void *ptr)
+    __attribute__((noreturn));
+
+static void heap_error(const char *msg, const void *ptr)
+{
+    fprintf(stderr, "mm: %s (%p)\n", msg, ptr);
+    abort();
+}
+
+/*
+ * a link to the heap as it is stored in a block.
+ */
+static inline int encode_link(int u)
+{
+#ifdef HARDENED
+    return u ^ (int)thardened.link_key;
+#else
+    return u;
+#endif
+}
+
+/*
+ * a stored link back to an offset,
+ *      anything but NIL or a word of the heap means the heap was overwritten.
+ */
+static inline int decode_link(int v)
+{
+#ifdef HARDENED
+    int u = v ^ (int)thardened.link_key;
+
+    if (u != NIL && ((u & 0x3) ||
+        (unsigned)u >= (unsigned)(mem_get_brk() - heap_pool)))
+        heap_error("corrupted free list link", heap_pool + u);
+    return u;
+#else
+    return v;
+#endif
 }
 
 
@@ -493,6 +935,8 @@ static inline unsigned short get_block_header_size(void *header)
 #define BLOCK_LINKED_LIST_NODE 2
 #define BLOCK_8_BYTE 3
 #define BLOCK_ALLOCATED 4
+#define BLOCK_SLAB_OBJECT 6
+#define BLOCK_MAPPED 7
 
 /*
  * 0, 1 bst node.
@@ -503,6 +947,9 @@ static inline unsigned short get_block_header_size(void *header)
  * 3 8-byte free block
  *
  * 4 allocated block
+ *
+ * (6 object of a slab, only in the header of a slab object)
+ * (7 mapped block, only in the header of a mapped block)
  */
 static inline int get_block_type(void *header)
 {
@@ -603,14 +1050,14 @@ static inline int *Child(int u, int ty)
  */
 static inline int get_Child(int u, int ty)
 {
-    return *Child(u, ty);
+    return decode_link(*Child(u, ty));
 }
 /*
  * child setter of a bst node.
  */
 static inline void set_Child(int u, int ty, int w)
 {
-    *Child(u, ty) = w;
+    *Child(u, ty) = encode_link(w);
 }
 
 /*
@@ -693,6 +1140,7 @@ static inline void set_as_linkedlist_head_free_block
     //clear_free_block_16bytes(header, 0);
 
     set_free_block_size(header, size);
+    linkedlist_bitmap |= 1u << (head - linkedlist_pool);
     set_linkedlist_next(header, *head);
     if (*head != NIL)
     {
@@ -702,6 +1150,26 @@ static inline void set_as_linkedlist_head_free_block
     *head = header - heap_pool;
 }
 
+#ifdef HARDENED
+/*
+ * the canary of the allocated block at <header>, while it is allocated.
+ */
+static inline int block_canary(void *header)
+{
+    return thardened.canary_key ^ (unsigned)(header - heap_pool) * 0x9e3779b1u;
+}
+#endif
+
+/*
+ * (re)arm the canary of an allocated block of <size> bytes.
+ */
+static inline void set_block_canary(void *header, int size)
+{
+#ifdef HARDENED
+    set_single_word(header + size, -1, block_canary(header));
+#endif
+}
+
 /*
  * change a free block to a allocated block
  *
@@ -710,6 +1178,7 @@ static inline void set_as_linkedlist_head_free_block
 static inline void set_as_allocated_block(void *header, int size)
 {
     set_single_word(header, 0, BLOCK_ALLOCATED | size);
+    set_block_canary(header, size);
 }
 
 
@@ -741,11 +1210,6 @@ static inline int get_free_block_size(void *header)
 
 
 
-
-static int *linkedlist_pool;
-
-
-
 /*
  * should use wrapper to access, couldn't be access directly
  */
@@ -770,7 +1234,7 @@ static inline int *linkedlist_prev(void *header)
 static inline int get_linkedlist_next(void *header)
 {
 
-    int next = get_single_word(header, 2);
+    int next = decode_link(get_single_word(header, 2));
     ////assert((size & 0x7) == 0);
     return next;
 }
@@ -782,18 +1246,18 @@ static inline int get_linkedlist_next(void *header)
 static inline int get_linkedlist_prev(void *header)
 {
     //assert(get_block_type(header) == 2);
-    int prev = get_single_word(header, 1);
+    int prev = decode_link(get_single_word(header, 1));
 
     return prev;
 }
 static inline void set_linkedlist_next(void *header, int next)
 {
-    *linkedlist_next(header) = next;
+    *linkedlist_next(header) = encode_link(next);
 }
 
 static inline void set_linkedlist_prev(void *header, int prev)
 {
-    *linkedlist_prev(header) = prev;
+    *linkedlist_prev(header) = encode_link(prev);
 }
 
 /*
@@ -824,11 +1288,21 @@ static inline int get_previous_free_block_size(void *header)
 }
 
 
-static inline unsigned short get_allocated_block_size(void *ptr)
+static inline int get_allocated_block_size(void *ptr)
 {
+#ifdef BYTE_8_ARRAY
+    /* a slot : 8 bytes of payload, as if it had a header */
     if (ptr < ptr_8_end)
-        return ALIGNMENT;
-    return get_half_word(ptr) & ~0x7;
+        return ALIGNMENT + BLOCK_OVERHEAD;
+#endif
+    int size = get_single_word(ptr, 0);
+
+#ifdef SLAB_ALLOCATOR
+    /* the upper half of a slab object header is its index in the slab */
+    if ((size & 0x7) == BLOCK_SLAB_OBJECT)
+        return size & 0xf8;
+#endif
+    return size & ~0x7;
 }
 
 
@@ -841,16 +1315,18 @@ int mm_init(void)
 {
     mem_init_virtual_brk();
 
+#ifdef BYTE_8_ARRAY
     ptr_8_begin = mem_get_brk();
 
-    mem_request(STACK_SIZE);
-
-    for(int *p = (int *)ptr_8_begin; p < (int *)ptr_8_end; ++p)
-        *p = DEADBEEF;
+    if (mem_request(STACK_SIZE) < 0)
+        return -1;
 
     ptr_8_end = mem_get_brk();
+    ptr_8_free = ~0u >> (32 - STACK_SIZE / ALIGNMENT);
+#endif
 
-    mem_request(ALIGNMENT - HEADER_SIZE);
+    if (mem_request(ALIGNMENT - HEADER_SIZE) < 0)
+        return -1;
 
 
     Payload = 0;
@@ -870,10 +1346,30 @@ int mm_init(void)
     linkedlist_pool = (int *)&tpool;
 
     for (int i = 0; i < LINKED_LIST_SIZE; ++i) linkedlist_pool[i] = 1;
+    linkedlist_bitmap = 0;
+
+    for (int i = 0; i < SLAB_CLASS_COUNT; ++i)
+        tslab.partial[i] = NIL, tslab.used[i] = 0;
+
+    for (int i = 0; i < MM_LIFETIMES; ++i)
+        tnursery.chunk[i] = NIL;
 
     heap_pool = mem_get_brk();
+    released_init();
 
-    bstro = NIL;
+    bstro = tclass.root;
+
+    for (int i = 0; i < BST_CLASS_COUNT; ++i) bstro[i] = NIL;
+    for (int i = 0; i < BST_FL_COUNT; ++i) tclass.sl_bitmap[i] = 0;
+    bst_fl_bitmap = 0;
+
+#ifdef THREAD_SAFE
+    ++arena_epoch;
+#endif
+
+#ifdef HARDENED
+    hardened_init();
+#endif
 
 
     //fprintf(stderr, "%s\n", "init finished");
@@ -1007,14 +1503,8 @@ int treap_insert(int u, int w)
 
     int ty = size_w > size_u;
 
-    int *pch = (int *) (header_u) + BST_NODE_CHLD_OFFSET + ty;
-    int ch = treap_insert(*pch, w);
-    *pch = ch;
-
-    /*
     int ch = treap_insert(get_Child(u, ty), w);
     set_Child(u, ty, ch);
-    */
 
     //assert(ch != 1);
     /*
@@ -1025,11 +1515,7 @@ int treap_insert(int u, int w)
     if (get_bst_node_ran(ch) < get_bst_node_ran(u))
     {
         //assert(v != NIL);
-        int *pchch =
-            (int *) (heap_pool + ch) + BST_NODE_CHLD_OFFSET + !ty;
-        *pch = *pchch;
-        *pchch = u;
-        return ch;
+        return rotate(u, ty);
     }
     
     return u;
@@ -1071,27 +1557,6 @@ int treap_delete(int u, int size_w)
         {
             //status |= DELETE__BST_NODE_DELETED;
 
-            int *pch = (int *) (header_u) + BST_NODE_CHLD_OFFSET;
-            
-            int lch = *pch, rch = *(pch + 1);
-            
-            if (lch == NIL)
-                return rch;
-
-            if (rch == NIL)
-                return lch;
-
-            int ty = get_bst_node_ran(lch) < get_bst_node_ran(rch);
-
-            int ch = *(pch + !ty);
-            
-            int *pchch =
-                (int *) (heap_pool + ch) + BST_NODE_CHLD_OFFSET + ty;
-            *(pch + !ty) = *pchch;
-
-            *pchch = treap_delete(u, size_w);
-            
-            /*
             int lch = get_Child(u, 0), rch = get_Child(u, 1);
             
             if (lch == NIL)
@@ -1106,8 +1571,7 @@ int treap_delete(int u, int size_w)
             int v = rotate(u, !ty);
             
             set_Child(v, ty, treap_delete(u, size_w));
-            */
-            return ch;
+            return v;
         }
         else
         {
@@ -1191,7 +1655,6 @@ void Treap_insert(int u)
 
 #ifdef INSERT_MONITOR
     dbg_printf("\n----------insert--------begin-----\n");
-    dbg_printf("root = %d\n", bstro);
     Display_bst();
     dbg_printf("ptr = ");
     
@@ -1220,11 +1683,14 @@ void Treap_insert(int u)
         {
             buf_en = 0;
             for(int i = 0; i < BUF_SIZE; ++i)
-                bstro = treap_insert(bstro, buf_node[i]);
+                bstro[0] = treap_insert(bstro[0], buf_node[i]);
         }
     }
     */
-    bstro = treap_insert(bstro, u);
+    int index = get_bst_class_index(get_free_block_size(heap_pool + u));
+
+    bstro[index] = treap_insert(bstro[index], u);
+    bst_class_mark(index);
 
 
 #ifdef INSERT_MONITOR
@@ -1254,7 +1720,6 @@ int Treap_delete(int u, int size)
     
 #ifdef DELETE_MONITOR
     dbg_printf("\n----------delete--------begin-----\n");
-    dbg_printf("root = %d\n", bstro);
     Display_bst();
     dbg_printf("deleten node = ");display_bst_node(u);
 
@@ -1276,7 +1741,11 @@ int Treap_delete(int u, int size)
     */
     
 
-    bstro = treap_delete(bstro, size);
+    int index = get_bst_class_index(size);
+
+    bstro[index] = treap_delete(bstro[index], size);
+    if (bstro[index] == NIL)
+        bst_class_unmark(index);
 
 
 #ifdef DELETE_MONITOR
@@ -1324,7 +1793,7 @@ int treap_select(int u, int size)
     {
         dbg_printf("ASSERT!!!\n");
         display_bst_node(u);
-        display_bst(bstro);
+        Display_bst();
         exit(0);
     }
 #endif
@@ -1400,26 +1869,39 @@ void *structure_select_free_block(int size)
 {
     int index = get_linkedlist_head_index(size);
 
-    for (int i = index; i < LINKED_LIST_SIZE; ++i)
+    if (index < LINKED_LIST_SIZE)
+    {
+        unsigned map = linkedlist_bitmap & (~0u << index);
 
         #ifdef BEST_FIT_UTIL_OPTIMIZATION_1
-            if (i != index + 1) // avoid 8-bytes block
+            map &= ~(2u << index); // avoid 8-bytes block
         #endif
 
-            //if (i != index + 2) // avoid 16-bytes block
+        if (map)
+            return heap_pool + linkedlist_pool[__builtin_ctz(map)];
+    }
 
-                if (linkedlist_pool[i] != 1)
-                {
-                    return heap_pool + linkedlist_pool[i];
-                }
 
+    /*
+     * the class of <size> may only hold smaller blocks,
+     * then the smallest block of the next non-empty class is the best fit.
+     */
+    int cls = get_bst_class_index(size);
 
-    //assert(bstro >= 0);
+    int node = NIL;
+    if (bstro[cls] != NIL)
+        node = Treap_select(bstro[cls], size);
 
-    int node = Treap_select(bstro, size);
-    
     if (node == NIL)
-        return NULL;
+    {
+        cls = bst_class_next(cls + 1);
+        if (cls < 0)
+            return NULL;
+        node = Treap_select(bstro[cls], size);
+    }
+
+    if (node == NIL)
+        return NULL;
     
     int actsize = get_free_block_size(heap_pool + node);
 
@@ -1483,7 +1965,10 @@ static int linkedlist_erase_head(void *header_u)
     linkedlist_pool[index] = u_next;
 
     if (u_next == NIL)
+    {
+        linkedlist_bitmap &= ~(1u << index);
         return 2;
+    }
 
     set_block_header_tag(heap_pool + u_next, 0);
     return 1;
@@ -1555,6 +2040,9 @@ int structure_erase_free_block(void *header)
 void structure_add_free_block(void *ptr, int size)
 {
     //assert(size >= 8);
+    unmark_released(ptr, size < FREE_BLOCK_META ? size : FREE_BLOCK_META);
+    unmark_released(ptr + size - ALIGNMENT, ALIGNMENT);
+
     if (size == 8)
     {
         set_as_8bytes_free_block(ptr);
@@ -1585,7 +2073,7 @@ void structure_add_free_block(void *ptr, int size)
 
 
 /*
- * malloc
+ * arena_malloc, the malloc of the heap itself.
  *
  * 1. align up the original size to asize. (asize >= size)
  *
@@ -1598,7 +2086,7 @@ void structure_add_free_block(void *ptr, int size)
  *              update the heap infomation.
  *
  */
-void *malloc(size_t size)
+static void *arena_malloc(size_t size)
 {
 #define MALLOC_MONITOR
 #ifdef MALLOC_MONITOR
@@ -1621,38 +2109,45 @@ void *malloc(size_t size)
 #endif
 
 
-    if (ALIGN(size) == 8)
+#ifdef SLAB_ALLOCATOR
+    if (ALIGN(size + HEADER_SIZE) <= SLAB_MAX_SIZE)
     {
-        for(long *p = (long *)ptr_8_begin; p < (long *)ptr_8_end; ++p)
-        {
-            if (*p == DEADBEEFx2)
-            {
-            #ifdef MALLOC_MONITOR
-                dbg_printf("--------------malloc ending--------\n\n\n");
-            #endif
-                return p;
-            }
-        }
+    #ifdef MALLOC_MONITOR
+        dbg_printf("--------------malloc ending--------\n\n\n");
+    #endif
+        return slab_malloc(ALIGN(size + HEADER_SIZE));
+    }
+#endif
+
+#ifdef BYTE_8_ARRAY
+    if (ALIGN(size) == 8 && ptr_8_free)
+    {
+        int k = __builtin_ctz(ptr_8_free);
+
+        ptr_8_free &= ptr_8_free - 1;
+    #ifdef MALLOC_MONITOR
+        dbg_printf("--------------malloc ending--------\n\n\n");
+    #endif
+        return ptr_8_begin + k * ALIGNMENT;
     }
+#endif
 
-    size = ALIGN(size + HEADER_SIZE);
+    size = ALIGN(size + BLOCK_OVERHEAD);
 
+    return malloc_block(size);
+}
+
+
+/*
+ * allocate a block of the heap,
+ *      size is aligned and includes the header.
+ */
+static void *malloc_block(size_t size)
+{
     void *ptr;
     int rest_size;
 
     //assert(size >= 8);
-#ifdef ALLOCATE_FOR_8_BYTE_BLOCK
-    if (size == 8)
-    {
-        ptr = mem_get_brk();
-        mem_request(size);
-        set_as_allocated_block(ptr, size);
-        #ifdef MALLOC_MONITOR
-            dbg_printf("--------------malloc ending--------\n\n\n");
-        #endif
-        return ptr + HEADER_SIZE;
-    }
-#endif
     /*
      * find a block with a size that is not smaller than its size
      *      in structure,
@@ -1692,7 +2187,8 @@ void *malloc(size_t size)
         
         ptr = mem_get_brk();
 
-        mem_request(size);
+        if (mem_request(size) < 0)
+            return NULL;
 
         set_as_allocated_block(ptr, size);
     }
@@ -1756,17 +2252,129 @@ static int coalesce_next_block(void **pheader, int size)
 }
 
 
+/*
+ * Releasing : the pages inside a large free block go back to the OS,
+ *      once the block has stayed free for a while.
+ *
+ *      Every RELEASE_INTERVAL frees, a sweep goes through the free blocks
+ *      of at least RELEASE_THRESHOLD bytes, and stamps each one with its
+ *      number (word RELEASE_STAMP_OFFSET of the block). A block that had
+ *      the stamp of the last sweep, free since then, gives back its whole
+ *      interior, all but the FREE_BLOCK_META bytes and the footer.
+ *      So does the space above the virtual brk that no block has reached
+ *      since the last sweep, and the heap is trimmed there. (see trim_heap)
+ *      (a block that only looks stamped is released early, no harm done)
+ *
+ *      A page given back keeps a bit in released_pages, calloc does not
+ *      clear it. It loses the bit when a block over it is freed, or when
+ *      a free block puts its meta or footer there.
+ */
+#define RELEASE_THRESHOLD   (256 << 10)
+#define RELEASE_INTERVAL    1024
+#define RELEASE_STAMP_OFFSET 7
+
+/*
+ * give back the whole pages of [lo, hi) not given back yet.
+ */
+static void release_pages(void *lo, void *hi)
+{
+    size_t page = mem_pagesize();
+
+    lo = (void *)(((size_t)lo + page - 1) & ~(page - 1));
+    hi = (void *)((size_t)hi & ~(page - 1));
+    if (lo >= hi)
+        return;
+
+    size_t i = released_page_index(lo), end = released_page_index(hi);
+    while (i < end)
+    {
+        while (i < end && page_is_released(i))
+            ++i;
+        size_t run = i;
+        while (i < end && !page_is_released(i))
+        {
+            released_pages[i / 32] |= 1u << (i % 32);
+            ++i;
+        }
+        if (run < i)
+            mem_release(lo + ((run - released_page_index(lo))
+                << RELEASE_PAGE_SHIFT), (i - run) << RELEASE_PAGE_SHIFT);
+    }
+    released_any = 1;
+}
+
+/*
+ * stamp a free block, and release it if the last sweep stamped it too.
+ */
+static void release_sweep_block(void *header)
+{
+    int *stamp = single_word(header, RELEASE_STAMP_OFFSET);
+
+    if (*stamp == release_sweep - 1)
+        release_pages(header + FREE_BLOCK_META,
+            header + get_free_block_size(header) - ALIGNMENT);
+    *stamp = release_sweep;
+}
+
+/*
+ * every node of a treap, and the blocks of the same size linked to it.
+ */
+static void release_sweep_treap(int u)
+{
+    for (; u != NIL; u = get_Child(u, 1))
+    {
+        release_sweep_treap(get_Child(u, 0));
+        for (int v = u; v != NIL; v = get_linkedlist_next(heap_pool + v))
+            release_sweep_block(heap_pool + v);
+    }
+}
+
+/*
+ * Trimming : the space above release_brk has stayed free since the last
+ *      sweep. Once it reaches TRIM_THRESHOLD, the actual brk goes down
+ *      to TRIM_PAD bytes above release_brk, by mem_sbrk.
+ *      Only at a sweep: a block freed and malloc'ed again at the top
+ *      never shrinks and grows the heap every time.
+ */
+#define TRIM_THRESHOLD  (128 << 10)
+#define TRIM_PAD        (64 << 10)
+
+static void trim_heap(void)
+{
+    if (ACTUAL_BRK - release_brk < TRIM_THRESHOLD)
+        return;
+
+    mem_sbrk(-(int)(ACTUAL_BRK - release_brk - TRIM_PAD));
+    if (heap_zero > mem_heap_zero())
+        heap_zero = mem_heap_zero();
+}
+
+/*
+ * the sweep, called every RELEASE_INTERVAL frees by free_by_header.
+ */
+static void release_free_blocks(void)
+{
+    ++release_sweep;
+    trim_heap();
+    release_pages(release_brk, ACTUAL_BRK);
+    release_brk = virtual_brk;
+
+    for (int i = bst_class_next(get_bst_class_index(RELEASE_THRESHOLD));
+            i >= 0; i = bst_class_next(i + 1))
+        release_sweep_treap(bstro[i]);
+}
+
 /*
  * free an allocated block by a specified header.
  */
 static void *free_by_header(void *header)
 {
     int size = get_allocated_block_size(header);
-    
 
     //assert(size >= 8);
 
     Payload -= size;
+    unmark_released(header, size);
 
     size += coalesce_prev_block(&header, size);
     
@@ -1784,233 +2392,2319 @@ static void *free_by_header(void *header)
         mem_shrink(header);
     }
 
+    if (++release_clock % RELEASE_INTERVAL == 0)
+        release_free_blocks();
+
 
     //assert(size >= 8);
     return header;
 }
 
 /*
- * free
  *
- * if the adjacent block is also free, then union them.
+ * Slabs for the small blocks.
+ *
+ *      slab block (an allocated block of the heap)
+ *
+ *          | header | free bitmap | next | prev | objects ...
+ *              4          4          4      4
+ *
+ *      object k of n, at slab + SLAB_META_SIZE + k * size
+ *
+ *          | header : k << 24 | n << 16 | size | BLOCK_SLAB_OBJECT | payload
+ *
+ * A slab with a free object is in the <partial> list of its class,
+ * a full slab isn't in any list.
  */
-void free(void *ptr)
-{
-#define FREE_MONITOR
-#ifdef FREE_MONITOR
-    dbg_printf("--------------free starting--------\n");
-    dbg_printf("free ptr =%p\n", ptr);
-    //Display_bst();
-#endif
-    
-    if (in_heap(ptr) == 0)
-        return;
-
-    if (ptr < ptr_8_end)
-    {
-        *((long *)ptr) = ~DEADBEEFx2;
-        return;
-    }
 
-    void *header = ptr - HEADER_SIZE;
-    (void) free_by_header(header);
 
-#ifdef FREE_MONITOR
-    dbg_printf("--------------free end--------\n");
-#endif
+static inline int get_slab_class_index(int size)
+{
+    return (size >> 3) - 1;
 }
 
 /*
- * realloc - Change the size of the block by mallocing a new block,
- *      copying its data, and freeing the old block.
+ * bitmap of a slab of n objects, all of them free.
  */
-void *realloc(void *oldptr, size_t size)
+static inline unsigned slab_empty_bitmap(int n)
 {
+    return n == 32 ? ~0u : (1u << n) - 1;
+}
 
-    void *ptr;
+static inline unsigned *slab_bitmap(void *slab)
+{
+    return (unsigned *)single_word(slab, 1);
+}
 
-    if (!oldptr)
-        return malloc(size);
-    
-    if (size == 0)
-        return free(oldptr), NULL;
+static inline int get_slab_next(void *slab)
+{
+    return get_single_word(slab, 2);
+}
 
-    size_t asize = get_allocated_block_size(oldptr - HEADER_SIZE);
-    size_t oldsize = asize - (ALIGNMENT - HEADER_SIZE);
-    /*
-     * this old_size is not the actual old_size,
-     *    so this "Payload" may not be precise.
-     */
-    Payload = Payload + size - oldsize;
-    ptr = malloc(size);
-    if (size < oldsize)
-        oldsize = size;
-    
-    return memcpy(ptr, oldptr, oldsize), free(oldptr), ptr;
+static inline int get_slab_prev(void *slab)
+{
+    return get_single_word(slab, 3);
 }
 
+static inline void set_slab_next(void *slab, int next)
+{
+    set_single_word(slab, 2, next);
+}
 
+static inline void set_slab_prev(void *slab, int prev)
+{
+    set_single_word(slab, 3, prev);
+}
 
 /*
- * calloc - Allocate the block and set it to zero.
+ * push a slab at the head of the partial list of its class.
  */
-void *calloc(size_t nmemb, size_t size)
+static void slab_link(void *slab, int *head)
 {
-    void *ptr;
-    size_t bytes = nmemb * size;
-    memset(ptr = malloc(bytes), 0, bytes);
-    return ptr;
+    set_slab_prev(slab, NIL);
+    set_slab_next(slab, *head);
+    if (*head != NIL)
+        set_slab_prev(heap_pool + *head, slab - heap_pool);
+    *head = slab - heap_pool;
 }
 
-
 /*
- * Return whether the pointer is in the heap.
- * May be useful for debugging.
+ * remove a slab from the partial list of its class.
  */
-static int in_heap(const void *p)
+static void slab_unlink(void *slab, int *head)
 {
-    return p < mem_get_brk() && p >= mem_heap_lo();
+    int prev = get_slab_prev(slab);
+    int next = get_slab_next(slab);
+
+    if (prev == NIL)
+        *head = next;
+    else
+        set_slab_next(heap_pool + prev, next);
+
+    if (next != NIL)
+        set_slab_prev(heap_pool + next, prev);
 }
 
 /*
- * Return whether the pointer is aligned.
- * May be useful for debugging.
+ * allocate a new slab of n <size> objects from the heap,
+ *      every object is free. (NULL if the heap is out of memory)
  */
-static int aligned(const void *p)
+static void *slab_create(int size, int n)
 {
-    return (size_t)ALIGN(p) == (size_t)p;
-}
+    void *slab = malloc_block(SLAB_META_SIZE + n * size);
+
+    if (slab == NULL)
+        return NULL;
+    slab -= HEADER_SIZE;
+
+    *slab_bitmap(slab) = slab_empty_bitmap(n);
 
+    for (int k = 0; k < n; ++k)
+        set_single_word(slab + SLAB_META_SIZE + k * size, 0,
+            (k << 24) | (n << 16) | size | BLOCK_SLAB_OBJECT);
+
+    return slab;
+}
 
 /*
- * traverse and print every node of a linkedlist
+ * malloc for the small blocks,
+ *      size is aligned and includes the header.
  */
-static void display_linkedlist(void *head)
+static void *slab_malloc(int size)
 {
-    dbg_printf("display_linkedlist.  begin : \n");
-    dbg_printf("[head node = %d size = %d]",
-        head - heap_pool,
-            get_free_block_size(head));
-    for(void *ptr = head; ; )
+    int index = get_slab_class_index(size);
+    int *head = tslab.partial + index;
+    void *slab;
+
+    if (*head == NIL)
     {
-        display_block_info(ptr);
-        //assert(get_block_type(ptr) != BLOCK_ALLOCATED );
-        int next = get_linkedlist_next(ptr);
-        dbg_printf("next={%d}", next);
-        if (next == NIL) break;
-        ptr = heap_pool + next;
-        dbg_printf(" -> [node = %d size = %d]",
-                next,
-                    get_free_block_size(ptr));
+        int n = tslab.used[index];
+
+        if (n < SLAB_MIN_OBJECTS) n = SLAB_MIN_OBJECTS;
+        if (n > SLAB_MAX_OBJECTS) n = SLAB_MAX_OBJECTS;
+        if ((slab = slab_create(size, n)) == NULL)
+            return NULL;
+        slab_link(slab, head);
     }
-    dbg_printf("-\n");
-    dbg_printf("display_linkedlist.  end\n ");
-}
+    ++tslab.used[index];
+
+    slab = heap_pool + *head;
+
+    unsigned *bitmap = slab_bitmap(slab);
+    int k = __builtin_ctz(*bitmap);
+
+    *bitmap &= *bitmap - 1;
+    if (*bitmap == 0)
+        slab_unlink(slab, head);
 
+    return slab + SLAB_META_SIZE + k * size + HEADER_SIZE;
+}
 
 /*
- * traverse and print every node of our BST
+ * free an object of a slab by its header.
  */
-static void display_bst(int u)
+static void slab_free(void *header)
 {
-    return;
-    if (u == NIL)
-        return;
+    int size = get_allocated_block_size(header);
+    int n = (get_single_word(header, 0) >> 16) & 0xff;
+    int k = (unsigned)get_single_word(header, 0) >> 24;
+    void *slab = header - SLAB_META_SIZE - k * size;
+    int index = get_slab_class_index(size);
+    int *head = tslab.partial + index;
 
-    display_bst_node(u);
+    unsigned *bitmap = slab_bitmap(slab);
 
-    for(int ty = 0; ty < 2; ++ty)
-        display_bst(get_Child(u, ty));
+    Payload -= size;
+    --tslab.used[index];
+
+    if (*bitmap == 0)
+        slab_link(slab, head);
+
+    *bitmap |= 1u << k;
+
+    if (*bitmap == slab_empty_bitmap(n))
+    {
+        slab_unlink(slab, head);
+        (void) free_by_header(slab);
+    }
 }
 
 /*
- * Wrapper of display_bst.
  *
- * display more information and check error.
+ * Nursery chunks.
+ *
+ *      chunk block (an allocated block of the heap)
+ *
+ *          | header | live objects | lifetime | unused | objects ...
+ *              4          4             4         4
+ *
+ *      object, <offset> bytes after the chunk header
+ *
+ *          | header : offset / 4 << 16 | NURSERY_OBJECT | size / 8 << 8
+ *                      | BLOCK_SLAB_OBJECT | payload
+ *
+ * A chunk that is no longer bumped is freed by the free of its last object,
+ * the one being bumped starts over instead.
  */
-static void Display_bst()
+static inline int is_nursery_object(void *header)
 {
-    dbg_printf("\n-----displaying-BST--start----\n");
-    dbg_printf("root = %d\n", bstro);
-    display_bst(bstro);
-    dbg_printf("\n-----displaying-BST--finish-----\n");
+#ifdef BYTE_8_ARRAY
+    if (header < ptr_8_end)
+        return 0;
+#endif
+    return (get_single_word(header, 0) & (NURSERY_OBJECT | 0x7))
+        == (NURSERY_OBJECT | BLOCK_SLAB_OBJECT);
+}
+
+static inline int get_nursery_object_size(void *header)
+{
+    return (get_single_word(header, 0) >> 5) & 0x3f8;
 }
 
 /*
- * mm_checkheap
- *
- * traversed the heap and check them, display block information.
- *
- * display the BST.
+ * malloc for a block expected to live <lifetime>,
+ *      size is aligned and includes the header.
  */
-void mm_checkheap(int verbose)
+static void *nursery_malloc(int size, int lifetime)
 {
-    dbg_printf("%s\n", "QAQ, an error has occurred");
+    int *chunk = tnursery.chunk + lifetime;
+    int *top = tnursery.top + lifetime;
+    void *header;
 
-    Display_bst();
+    if (*chunk == NIL || *top + size >
+        *chunk + get_allocated_block_size(heap_pool + *chunk))
+    {
+        /* the old chunk is left to its objects */
+        int chunk_size = ALIGN(mem_heapsize() >> NURSERY_CHUNK_SHIFT);
+
+        if (chunk_size < NURSERY_MIN_CHUNK)
+            chunk_size = NURSERY_MIN_CHUNK;
+        if (chunk_size > NURSERY_MAX_CHUNK)
+            chunk_size = NURSERY_MAX_CHUNK;
+
+        if ((header = malloc_block(chunk_size)) == NULL)
+            return NULL;
+        header -= HEADER_SIZE;
+        set_single_word(header, 1, 0);
+        set_single_word(header, 2, lifetime);
+
+        *chunk = header - heap_pool;
+        *top = *chunk + NURSERY_META_SIZE;
+    }
 
-    display_bst_node(bstro);
+    header = heap_pool + *top;
+    set_single_word(header, 0, ((*top - *chunk) >> 2 << 16) | (size << 5)
+        | NURSERY_OBJECT | BLOCK_SLAB_OBJECT);
+    *top += size;
+    ++*single_word(heap_pool + *chunk, 1);
 
-    dbg_printf("heap : lo = %x  hi = %x   actual size = %d\n",
-        (int)mem_heap_lo(),
-            (int)(mem_get_brk() - 1),
-                (int)mem_heapsize());
+    Payload += size;
+    return header + HEADER_SIZE;
+}
 
-    int allocated = 1;
-    for(void *p = heap_pool; p < mem_get_brk(); )
+/*
+ * free an object of a chunk by its header.
+ */
+static void nursery_free(void *header)
+{
+    int size = get_nursery_object_size(header);
+    void *chunk = header - ((unsigned)get_single_word(header, 0) >> 16 << 2);
+    int lifetime = get_single_word(chunk, 2);
+    int *top = tnursery.top + lifetime;
+
+    Payload -= size;
+
+    if (chunk - heap_pool != tnursery.chunk[lifetime])
     {
-        display_block_info(p);
-        assert(aligned(p + HEADER_SIZE));
-        int u = p - heap_pool;
-        int type = get_block_type(p);
-        if (type == BLOCK_ALLOCATED)
-        {
-            allocated = 0;
-            p += get_allocated_block_size(p);
-            continue;
-        }
+        if (--*single_word(chunk, 1) == 0)
+            (void) free_by_header(chunk);
+        return;
+    }
 
-        assert(allocated);
-        allocated = 0;
-        switch (type)
-        {
-            case BLOCK_8_BYTE:
-                p = p + ALIGNMENT;
-            break;
+    /* the last object bumped is taken back at once */
+    if (header + size == heap_pool + *top)
+        *top -= size;
 
-            case BLOCK_LINKED_LIST_NODE:
-                assert(u ==
-                        get_linkedlist_next(
+    if (--*single_word(chunk, 1) == 0)
+        *top = tnursery.chunk[lifetime] + NURSERY_META_SIZE;
+}
+
+
+/*
+ * arena_free, the free of the heap itself.
+ *
+ * if the adjacent block is also free, then union them.
+ */
+static void arena_free(void *ptr)
+{
+#define FREE_MONITOR
+#ifdef FREE_MONITOR
+    dbg_printf("--------------free starting--------\n");
+    dbg_printf("free ptr =%p\n", ptr);
+    //Display_bst();
+#endif
+    
+    if (in_heap(ptr) == 0)
+        return;
+
+#ifdef BYTE_8_ARRAY
+    if (ptr < ptr_8_end)
+    {
+        ptr_8_free |= 1u << (ptr - ptr_8_begin) / ALIGNMENT;
+        return;
+    }
+#endif
+
+    void *header = ptr - HEADER_SIZE;
+
+    if (get_block_header_tag(header) == BLOCK_SLAB_OBJECT)
+    {
+#ifdef SLAB_ALLOCATOR
+        if (!is_nursery_object(header))
+        {
+            slab_free(header);
+            return;
+        }
+#endif
+        nursery_free(header);
+        return;
+    }
+
+    (void) free_by_header(header);
+
+#ifdef FREE_MONITOR
+    dbg_printf("--------------free end--------\n");
+#endif
+}
+
+#ifdef THREAD_SAFE
+/*
+ *
+ * Thread cache.
+ *
+ *      Blocks up to TCACHE_MAX_SIZE (header included) are kept in a
+ *      per-thread list for each size class, linked through the first
+ *      word of the payload. They stay allocated in the heap.
+ *
+ *      An empty list takes TCACHE_BATCH blocks from the heap at once,
+ *      a list longer than TCACHE_LIMIT gives TCACHE_BATCH back,
+ *      so the lock is taken once per batch instead of once per call.
+ *
+ *      Not with HARDENED: a cached block is handed out again by the next
+ *      malloc of its size, it would skip the quarantine.
+ *
+ * There is a single heap (one brk in memlib), so a single arena.
+ */
+#define TCACHE_MAX_SIZE     128
+#define TCACHE_CLASS_COUNT  (TCACHE_MAX_SIZE >> 3)
+#define TCACHE_BATCH        16
+#define TCACHE_LIMIT        64
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+struct TCache
+{
+    int head[TCACHE_CLASS_COUNT];
+    int count[TCACHE_CLASS_COUNT];
+    int epoch;
+};
+
+static __thread struct TCache tcache;
+
+
+/*
+ * give the first n blocks of a class back to the heap.
+ */
+static void tcache_flush(struct TCache *tc, int index, int n)
+{
+    pthread_mutex_lock(&arena_lock);
+    for (; n > 0 && tc->count[index] > 0; --n, --tc->count[index])
+    {
+        void *ptr = heap_pool + tc->head[index];
+
+        tc->head[index] = decode_link(get_single_word(ptr, 0));
+        arena_free(ptr);
+    }
+    pthread_mutex_unlock(&arena_lock);
+}
+
+/*
+ * thread exit : give every cached block back.
+ */
+static void tcache_destroy(void *arg)
+{
+    struct TCache *tc = arg;
+
+    if (tc->epoch != arena_epoch)
+        return;
+
+    for (int i = 0; i < TCACHE_CLASS_COUNT; ++i)
+        tcache_flush(tc, i, tc->count[i]);
+}
+
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * the cache of this thread, emptied if it was filled from an old heap.
+ */
+static inline struct TCache *get_tcache(void)
+{
+    struct TCache *tc = &tcache;
+
+    if (tc->epoch != arena_epoch)
+    {
+        for (int i = 0; i < TCACHE_CLASS_COUNT; ++i)
+            tc->count[i] = 0;
+        tc->epoch = arena_epoch;
+
+        pthread_once(&tcache_key_once, tcache_key_init);
+        pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+/*
+ * malloc for the small blocks,
+ *      size is aligned and includes the header.
+ */
+static void *tcache_malloc(int size)
+{
+    struct TCache *tc = get_tcache();
+    int index = (size >> 3) - 1;
+    void *ptr;
+
+    if (tc->count[index] == 0)
+    {
+        int n = 0;
+
+        /* a batch cut short by the end of the heap is still a batch */
+        tc->head[index] = NIL;
+        pthread_mutex_lock(&arena_lock);
+        for (; n < TCACHE_BATCH; ++n)
+        {
+            if ((ptr = arena_malloc(size - BLOCK_OVERHEAD)) == NULL)
+                break;
+            set_single_word(ptr, 0, encode_link(tc->head[index]));
+            tc->head[index] = ptr - heap_pool;
+        }
+        pthread_mutex_unlock(&arena_lock);
+        if (n == 0)
+            return NULL;
+        tc->count[index] = n;
+    }
+
+    ptr = heap_pool + tc->head[index];
+    tc->head[index] = decode_link(get_single_word(ptr, 0));
+    --tc->count[index];
+    set_block_canary(ptr - HEADER_SIZE, size);
+    return ptr;
+}
+
+/*
+ * free for the small blocks.
+ */
+static void tcache_free(void *ptr, int size)
+{
+    struct TCache *tc = get_tcache();
+    int index = (size >> 3) - 1;
+
+    /* the head of an empty list is stale, it could be out of the heap now */
+    set_single_word(ptr, 0,
+        encode_link(tc->count[index] ? tc->head[index] : NIL));
+    tc->head[index] = ptr - heap_pool;
+
+    if (++tc->count[index] > TCACHE_LIMIT)
+        tcache_flush(tc, index, TCACHE_BATCH);
+}
+#endif
+
+
+#ifdef HARDENED
+/*
+ * abort unless <ptr> is the payload of a live allocated block of the heap.
+ *
+ *      the header must be an allocated one that fits in the heap,
+ *      and the canary must be intact: its complement is a block freed
+ *      (or quarantined) already, anything else a write past the block.
+ */
+static void check_allocated_block(void *ptr)
+{
+    void *header = ptr - HEADER_SIZE;
+
+    if (!aligned(ptr))
+        heap_error("free of an invalid pointer", ptr);
+
+    int word = get_single_word(header, 0);
+    int size = word & ~0x7;
+
+    if ((word & 0x6) != BLOCK_ALLOCATED || size < 2 * ALIGNMENT ||
+        size > mem_get_brk() - header)
+        heap_error("free of an invalid pointer", ptr);
+
+    int canary = get_single_word(header + size, -1);
+
+    if (canary == ~block_canary(header))
+        heap_error("double free", ptr);
+    if (canary != block_canary(header))
+        heap_error("heap overflow past the block", ptr);
+}
+
+/*
+ * the canary of a freed block, until the heap takes the block back.
+ */
+static inline void set_block_freed(void *header)
+{
+    set_single_word(header + get_allocated_block_size(header), -1,
+        ~block_canary(header));
+}
+
+/*
+ * the oldest block of the quarantine leaves it for the heap.
+ */
+static void quarantine_release(void)
+{
+    struct THardened *h = &thardened;
+    void *oldest = heap_pool + h->quarantine[h->quarantine_head];
+
+    h->quarantine_bytes -= get_allocated_block_size(oldest - HEADER_SIZE);
+    h->quarantine_head = (h->quarantine_head + 1) % QUARANTINE_SIZE;
+    h->quarantine_count--;
+    arena_free(oldest);
+}
+
+/*
+ * put a freed block in the quarantine, and give the oldest ones
+ *      to the heap while it holds more than QUARANTINE_BYTES.
+ *      (a block larger than that goes through at once)
+ */
+static void quarantine_free(void *ptr)
+{
+    struct THardened *h = &thardened;
+
+    if (h->quarantine_count == QUARANTINE_SIZE)
+        quarantine_release();
+
+    h->quarantine[(h->quarantine_head + h->quarantine_count++)
+        % QUARANTINE_SIZE] = ptr - heap_pool;
+    h->quarantine_bytes += get_allocated_block_size(ptr - HEADER_SIZE);
+
+    while (h->quarantine_bytes > QUARANTINE_BYTES)
+        quarantine_release();
+}
+#endif
+
+
+/*
+ * Return whether ptr is the payload of a block mapped by malloc_mapped.
+ */
+static inline int is_mapped_block(void *ptr)
+{
+    return ptr != NULL && in_heap(ptr) == 0 && mem_is_mapped(ptr);
+}
+
+static inline size_t get_mapped_block_size(void *ptr)
+{
+    return *(size_t *)(ptr - MAPPED_HEADER_SIZE) - MAPPED_HEADER_SIZE;
+}
+
+static inline void *get_mapped_block_region(void *ptr)
+{
+    return ptr - MAPPED_HEADER_SIZE - get_single_word(ptr, -2);
+}
+
+/*
+ * map a region of its own for a large block, its payload aligned
+ *      to <alignment> (a power of 2), or MAPPED_HEADER_SIZE bytes after
+ *      the page boundary if alignment is 0.
+ */
+static void *malloc_mapped(size_t size, size_t alignment)
+{
+    void *region = mem_map(size + MAPPED_HEADER_SIZE + alignment);
+    void *ptr;
+
+    if (region == (void *)-1)
+        return NULL;
+
+    ptr = region + MAPPED_HEADER_SIZE;
+    if (alignment)
+        ptr = (void *)(((size_t)ptr + alignment - 1) & ~(alignment - 1));
+
+    *(size_t *)(ptr - MAPPED_HEADER_SIZE) = ALIGN(size + MAPPED_HEADER_SIZE);
+    set_single_word(ptr, -2, ptr - MAPPED_HEADER_SIZE - region);
+    set_single_word(ptr, -1, BLOCK_MAPPED);
+    return ptr;
+}
+
+static void free_mapped(void *ptr)
+{
+    mem_unmap(get_mapped_block_region(ptr));
+}
+
+/*
+ * resize a mapped block, the kernel moves its pages instead of copying.
+ *      The payload keeps its offset in the region, not its alignment.
+ */
+static void *realloc_mapped(void *oldptr, size_t size)
+{
+    int offset = oldptr - get_mapped_block_region(oldptr);
+    void *region = mem_remap(get_mapped_block_region(oldptr),
+        size + offset);
+
+    if (region == (void *)-1)
+        return NULL;
+
+    *(size_t *)(region + offset - MAPPED_HEADER_SIZE) =
+        ALIGN(size + MAPPED_HEADER_SIZE);
+    return region + offset;
+}
+
+/*
+ * malloc
+ */
+void *malloc(size_t size)
+{
+    if (size >= MMAP_THRESHOLD)
+        return malloc_mapped(size, 0);
+
+#ifdef THREAD_SAFE
+    if (size == 0)
+        return NULL;
+
+#ifndef HARDENED
+    if (size <= TCACHE_MAX_SIZE - BLOCK_OVERHEAD)
+        return tcache_malloc(ALIGN(size + BLOCK_OVERHEAD));
+#endif
+
+    pthread_mutex_lock(&arena_lock);
+    void *ptr = arena_malloc(size);
+    pthread_mutex_unlock(&arena_lock);
+    return ptr;
+#else
+    return arena_malloc(size);
+#endif
+}
+
+/*
+ * malloc_hint - malloc for a block expected to live <lifetime>
+ *      (MM_LIFETIME_*), a short-lived block goes to the nursery
+ *      of its lifetime instead of the heap.
+ */
+void *malloc_hint(size_t size, int lifetime)
+{
+#ifdef HARDENED
+    /* a nursery object has no canary */
+    return malloc(size);
+#else
+    if (lifetime <= MM_LIFETIME_DEFAULT || lifetime >= MM_LIFETIMES ||
+        size == 0 || size > NURSERY_MAX_SIZE - HEADER_SIZE)
+        return malloc(size);
+
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&arena_lock);
+    void *ptr = nursery_malloc(ALIGN(size + HEADER_SIZE), lifetime);
+    pthread_mutex_unlock(&arena_lock);
+    return ptr;
+#else
+    return nursery_malloc(ALIGN(size + HEADER_SIZE), lifetime);
+#endif
+#endif
+}
+
+/*
+ * free
+ */
+void free(void *ptr)
+{
+    if (is_mapped_block(ptr))
+    {
+        free_mapped(ptr);
+        return;
+    }
+
+#ifdef HARDENED
+    if (in_heap(ptr) == 0)
+        return;
+
+    check_allocated_block(ptr);
+    set_block_freed(ptr - HEADER_SIZE);
+#endif
+
+#ifdef THREAD_SAFE
+    if (in_heap(ptr) == 0)
+        return;
+
+#ifndef HARDENED
+    int size = get_allocated_block_size(ptr - HEADER_SIZE);
+
+    if (size <= TCACHE_MAX_SIZE && !is_nursery_object(ptr - HEADER_SIZE))
+    {
+        tcache_free(ptr, size);
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&arena_lock);
+#ifdef HARDENED
+    quarantine_free(ptr);
+#else
+    arena_free(ptr);
+#endif
+    pthread_mutex_unlock(&arena_lock);
+#else
+#ifdef HARDENED
+    quarantine_free(ptr);
+#else
+    arena_free(ptr);
+#endif
+#endif
+}
+
+/*
+ * the block [header, header + total) is no longer in the structure,
+ *      keep the first <size> bytes as an allocated block
+ *      and give the rest back to the structure (or to the brk).
+ *
+ * prev_tag : PREV_ISFREE_BIT of the header, or 0.
+ */
+static void split_allocated_block(void *header, int total, int size,
+    int prev_tag)
+{
+    int rest = total - size;
+    void *tail = header + size;
+
+    set_single_word(header, 0, BLOCK_ALLOCATED | size | prev_tag);
+    set_block_canary(header, size);
+
+    if (rest == 0)
+    {
+        /* a free block after it is left alone, its tag is its type */
+        if (tail < mem_get_brk() && get_block_type(tail) == BLOCK_ALLOCATED)
+            set_tag_previous_block_isallocated(tail);
+        return;
+    }
+
+    unmark_released(tail, rest);
+    if (tail + rest < mem_get_brk())
+    {
+        rest += coalesce_next_block(&tail, rest);
+        structure_add_free_block(tail, rest);
+    }
+    else
+    {
+        mem_shrink(tail);
+    }
+}
+
+/*
+ * resize an allocated block without moving its payload if possible,
+ *
+ *      + shrink : the tail goes back to the structure.
+ *      + grow   : take the next free block, and / or extend the brk
+ *                 if the block is the last one of the heap.
+ *      + grow   : take the previous free block too, and move the payload
+ *                 down. (still no new block)
+ *
+ * return the new payload, or NULL if it needs malloc-copy-free.
+ */
+static void *realloc_in_place(void *oldptr, size_t size)
+{
+    void *header = oldptr - HEADER_SIZE;
+
+#ifdef BYTE_8_ARRAY
+    if (oldptr < ptr_8_end)
+        return NULL;
+#endif
+    if (get_block_header_tag(header) == BLOCK_SLAB_OBJECT)
+        return NULL;
+
+    int oldsize = get_allocated_block_size(header);
+    int asize = ALIGN(size + BLOCK_OVERHEAD);
+    int prev_tag = get_block_header_tag(header) & PREV_ISFREE_BIT;
+
+    if (asize <= oldsize)
+    {
+        split_allocated_block(header, oldsize, asize, prev_tag);
+        return oldptr;
+    }
+
+    /*
+     * the free space just after the block,
+     *      and whether the brk could be extended after it.
+     */
+    void *next = header + oldsize;
+    int next_size = 0;
+    int at_top = next >= mem_get_brk();
+
+    if (!at_top && get_block_type(next) != BLOCK_ALLOCATED)
+    {
+        next_size = get_block_type(next) == BLOCK_8_BYTE ?
+            ALIGNMENT : get_free_block_size(next);
+        at_top = next + next_size >= mem_get_brk();
+    }
+
+    if (oldsize + next_size >= asize || at_top)
+    {
+        int grow = asize - oldsize - next_size;
+
+        if (grow > 0 && mem_request(grow) < 0)
+            return NULL;
+        if (next_size)
+            (void) coalesce_next_block(&header, oldsize);
+        if (grow > 0)
+            next_size += grow;
+        split_allocated_block(header, oldsize + next_size, asize, prev_tag);
+        return oldptr;
+    }
+
+    if (prev_tag)
+    {
+        int prev_size = get_previous_free_block_size(header);
+
+        if (prev_size + oldsize + next_size >= asize)
+        {
+            if (next_size)
+                (void) coalesce_next_block(&header, oldsize);
+            (void) coalesce_prev_block(&header, oldsize);
+
+            memmove(header + HEADER_SIZE, oldptr, oldsize - HEADER_SIZE);
+            split_allocated_block(header, prev_size + oldsize + next_size,
+                asize, 0);
+            return header + HEADER_SIZE;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * realloc - Resize the block in place if the heap around it allows,
+ *      otherwise malloc a new block, copy its data, and free the old block.
+ */
+void *realloc(void *oldptr, size_t size)
+{
+
+    void *ptr;
+
+    if (!oldptr)
+        return malloc(size);
+    
+    if (size == 0)
+        return free(oldptr), NULL;
+
+    size_t oldsize;
+
+    if (is_mapped_block(oldptr))
+    {
+        if (size >= MMAP_THRESHOLD)
+            return realloc_mapped(oldptr, size);
+        oldsize = get_mapped_block_size(oldptr);
+    }
+    else
+    {
+        void *header = oldptr - HEADER_SIZE;
+#ifdef HARDENED
+        check_allocated_block(oldptr);
+#endif
+        size_t asize = is_nursery_object(header) ?
+            get_nursery_object_size(header) : get_allocated_block_size(header);
+        oldsize = asize - BLOCK_OVERHEAD;
+        /*
+         * this old_size is not the actual old_size,
+         *    so this "Payload" may not be precise.
+         */
+        Payload = Payload + size - oldsize;
+
+        /* a block growing past MMAP_THRESHOLD moves out of the heap */
+        if (size < MMAP_THRESHOLD)
+        {
+#ifdef THREAD_SAFE
+            pthread_mutex_lock(&arena_lock);
+            ptr = realloc_in_place(oldptr, size);
+            pthread_mutex_unlock(&arena_lock);
+#else
+            ptr = realloc_in_place(oldptr, size);
+#endif
+            if (ptr)
+                return ptr;
+        }
+    }
+
+    if ((ptr = malloc(size)) == NULL)
+        return NULL;
+    if (size < oldsize)
+        oldsize = size;
+    
+    return memcpy(ptr, oldptr, oldsize), free(oldptr), ptr;
+}
+
+
+
+/*
+ * allocate a block of the heap whose payload is aligned to <alignment>,
+ *      carved out of a block large enough for any offset of the payload:
+ *      the fragment before it goes back to the structure,
+ *      the one after it too. (or to the brk)
+ *
+ * alignment is a power of 2 above ALIGNMENT, and below the page size.
+ */
+static void *memalign_block(size_t size, size_t alignment)
+{
+    int asize = ALIGN(size + BLOCK_OVERHEAD);
+    int total = asize + alignment - ALIGNMENT;
+    void *ptr = malloc_block(total);
+
+    if (ptr == NULL)
+        return NULL;
+
+    void *header = ptr - HEADER_SIZE;
+    int lead = -(size_t)ptr & (alignment - 1);
+
+    Payload += size;
+
+    if (lead == 0)
+    {
+        split_allocated_block(header, total, asize, 0);
+        return ptr;
+    }
+
+    /* the block before is allocated, or it would have been joined */
+    set_as_allocated_block(header + lead, total - lead);
+    structure_add_free_block(header, lead);
+    split_allocated_block(header + lead, total - lead, asize,
+        PREV_ISFREE_BIT);
+    return ptr + lead;
+}
+
+/*
+ * memalign - Allocate a block whose payload is aligned to <alignment>,
+ *      a power of 2.
+ *
+ * A page (or larger) alignment maps a region of its own, as a large block
+ * does: the heap would be left with a hole below each of them.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment & (alignment - 1))
+        return NULL;
+
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+
+    if (alignment >= mem_pagesize() || size >= MMAP_THRESHOLD - alignment)
+        return malloc_mapped(size, alignment);
+
+    if (size == 0)
+        return NULL;
+
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&arena_lock);
+    void *ptr = memalign_block(size, alignment);
+    pthread_mutex_unlock(&arena_lock);
+    return ptr;
+#else
+    return memalign_block(size, alignment);
+#endif
+}
+
+/*
+ * usable size of the payload of an allocated block.
+ */
+static size_t get_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+
+    if (is_mapped_block(ptr))
+        return get_mapped_block_size(ptr);
+
+    if (is_nursery_object(ptr - HEADER_SIZE))
+        return get_nursery_object_size(ptr - HEADER_SIZE) - HEADER_SIZE;
+
+    return get_allocated_block_size(ptr - HEADER_SIZE) - BLOCK_OVERHEAD;
+}
+
+/*
+ * clear [ptr, ptr + bytes) of a block calloc got from the heap,
+ *      but not from <zero> up, nor the pages whose bit is set in <released>.
+ *      (released[0] has the bit of page <base>, or NULL if no page is)
+ */
+#define CALLOC_RELEASED_WORDS ((MMAP_THRESHOLD >> RELEASE_PAGE_SHIFT) / 32 + 2)
+
+static void calloc_clear(void *ptr, size_t bytes, void *zero,
+    const unsigned *released, size_t base)
+{
+    void *end = ptr + bytes < zero ? ptr + bytes : zero;
+    void *run = ptr;    /* the bytes from here on are still to clear */
+
+    if (released != NULL)
+        for (void *p = ptr, *next; p < end; p = next)
+        {
+            size_t i = released_page_index(p) - base;
+
+            next = (void *)((((size_t)p >> RELEASE_PAGE_SHIFT) + 1)
+                << RELEASE_PAGE_SHIFT);
+            if (released[i / 32] >> (i % 32) & 1)
+            {
+                if (run < p)
+                    memset(run, 0, p - run);
+                run = next;
+            }
+        }
+    if (run < end)
+        memset(run, 0, end - run);
+}
+
+/*
+ * calloc - Allocate the block and set it to zero.
+ *      NULL if nmemb * size overflows. A mapped block is fresh zero
+ *      pages, and a heap block is only cleared below heap_zero,
+ *      and where its pages were not released. (see calloc_clear)
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr, *zero;
+    size_t bytes = nmemb * size;
+    const unsigned *released = NULL;
+    size_t base = 0;
+
+    if (size && nmemb > (size_t)-1 / size)
+        return NULL;
+
+    if (bytes >= MMAP_THRESHOLD)
+        return malloc_mapped(bytes, 0);
+
+#ifdef THREAD_SAFE
+    unsigned map[CALLOC_RELEASED_WORDS];
+
+    if (bytes == 0)
+        return NULL;
+
+#ifndef HARDENED
+    if (bytes <= TCACHE_MAX_SIZE - BLOCK_OVERHEAD)
+    {
+        if ((ptr = tcache_malloc(ALIGN(bytes + BLOCK_OVERHEAD))) != NULL)
+            memset(ptr, 0, bytes);
+        return ptr;
+    }
+#endif
+
+    /* the bits are read under the lock, the clearing is done outside */
+    pthread_mutex_lock(&arena_lock);
+    zero = heap_zero;
+    ptr = arena_malloc(bytes);
+    if (ptr != NULL && released_any)
+    {
+        base = released_page_index(ptr) & ~(size_t)31;
+        memcpy(map, released_pages + base / 32, sizeof(unsigned)
+            * (released_page_index(ptr + bytes - 1) / 32 - base / 32 + 1));
+        released = map;
+    }
+    pthread_mutex_unlock(&arena_lock);
+#else
+    zero = heap_zero;
+    ptr = arena_malloc(bytes);
+    if (released_any)
+        released = released_pages;
+#endif
+
+    if (ptr != NULL)
+        calloc_clear(ptr, bytes, zero, released, base);
+    return ptr;
+}
+
+
+/*
+ *
+ * Arenas.
+ *
+ *      chunk (a block from malloc, so maybe a mapped one)
+ *
+ *          | next chunk (8) | end of the chunk (8) | blocks ...
+ *
+ * The chunks of an arena are a list, bumped in order: the chunks after
+ * the one being bumped are empty, kept by a reset or the end of a scope
+ * for the blocks to come. A new chunk is twice as large as the last one,
+ * up to ARENA_MAX_CHUNK, or just large enough for a larger block.
+ */
+#define ARENA_MIN_CHUNK (4 << 10)
+#define ARENA_MAX_CHUNK (64 << 10)
+
+struct mm_arena_chunk
+{
+    struct mm_arena_chunk *next;
+    char *end;
+};
+
+struct mm_arena
+{
+    struct mm_arena_chunk *first;
+    struct mm_arena_chunk *chunk;   /* being bumped, NULL before the first */
+    char *top, *end;                /* its free space */
+    size_t chunk_size;              /* of the next new chunk */
+};
+
+mm_arena_t *mm_arena_create(void)
+{
+    mm_arena_t *arena = malloc(sizeof(*arena));
+
+    if (arena == NULL)
+        return NULL;
+
+    arena->first = arena->chunk = NULL;
+    arena->top = arena->end = NULL;
+    arena->chunk_size = ARENA_MIN_CHUNK;
+    return arena;
+}
+
+/*
+ * bump the chunk after the current one, or a new chunk put there
+ *      if it is missing or too small for <size> bytes.
+ */
+static int arena_next_chunk(mm_arena_t *arena, size_t size)
+{
+    struct mm_arena_chunk *next =
+        arena->chunk ? arena->chunk->next : arena->first;
+
+    if (next == NULL ||
+        (size_t)(next->end - (char *)(next + 1)) < size)
+    {
+        size_t chunk_size = arena->chunk_size;
+        struct mm_arena_chunk *chunk;
+
+        if (chunk_size < size + sizeof(*chunk))
+            chunk_size = size + sizeof(*chunk);
+        else if (arena->chunk_size < ARENA_MAX_CHUNK)
+            arena->chunk_size <<= 1;
+
+        if ((chunk = malloc(chunk_size)) == NULL)
+            return -1;
+        chunk->end = (char *)chunk + chunk_size;
+        chunk->next = next;
+
+        if (arena->chunk)
+            arena->chunk->next = chunk;
+        else
+            arena->first = chunk;
+        next = chunk;
+    }
+
+    arena->chunk = next;
+    arena->top = (char *)(next + 1);
+    arena->end = next->end;
+    return 0;
+}
+
+void *mm_arena_malloc(mm_arena_t *arena, size_t size)
+{
+    void *ptr;
+
+    size = ALIGN(size);
+    if (size > (size_t)(arena->end - arena->top) &&
+        arena_next_chunk(arena, size) < 0)
+        return NULL;
+
+    ptr = arena->top;
+    arena->top += size;
+    return ptr;
+}
+
+/*
+ * mm_arena_enter - Begin a nested scope, the blocks from now on are freed
+ *      by mm_arena_leave, those of the scopes around it are kept.
+ */
+mm_arena_scope_t mm_arena_enter(mm_arena_t *arena)
+{
+    mm_arena_scope_t scope = { arena->chunk, arena->top };
+
+    return scope;
+}
+
+void mm_arena_leave(mm_arena_t *arena, mm_arena_scope_t scope)
+{
+    arena->chunk = scope.chunk;
+    arena->top = scope.top;
+    arena->end = arena->chunk ? arena->chunk->end : NULL;
+}
+
+/*
+ * mm_arena_reset - Free every block of the arena, but keep its chunks.
+ */
+void mm_arena_reset(mm_arena_t *arena)
+{
+    arena->chunk = NULL;
+    arena->top = arena->end = NULL;
+}
+
+/*
+ * mm_arena_destroy - Free every block and give the chunks back to the heap.
+ */
+void mm_arena_destroy(mm_arena_t *arena)
+{
+    struct mm_arena_chunk *chunk, *next;
+
+    for (chunk = arena->first; chunk; chunk = next)
+    {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(arena);
+}
+
+
+/*
+ * Return whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static int in_heap(const void *p)
+{
+    return p < mem_get_brk() && p >= mem_heap_lo();
+}
+
+/*
+ * Return whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static int aligned(const void *p)
+{
+    return (size_t)ALIGN(p) == (size_t)p;
+}
+
+
+/*
+ * traverse and print every node of a linkedlist
+ */
+static void display_linkedlist(void *head)
+{
+    dbg_printf("display_linkedlist.  begin : \n");
+    dbg_printf("[head node = %d size = %d]",
+        head - heap_pool,
+            get_free_block_size(head));
+    for(void *ptr = head; ; )
+    {
+        display_block_info(ptr);
+        //assert(get_block_type(ptr) != BLOCK_ALLOCATED );
+        int next = get_linkedlist_next(ptr);
+        dbg_printf("next={%d}", next);
+        if (next == NIL) break;
+        ptr = heap_pool + next;
+        dbg_printf(" -> [node = %d size = %d]",
+                next,
+                    get_free_block_size(ptr));
+    }
+    dbg_printf("-\n");
+    dbg_printf("display_linkedlist.  end\n ");
+}
+
+
+/*
+ * traverse and print every node of our BST
+ */
+static void display_bst(int u)
+{
+    return;
+    if (u == NIL)
+        return;
+
+    display_bst_node(u);
+
+    for(int ty = 0; ty < 2; ++ty)
+        display_bst(get_Child(u, ty));
+}
+
+/*
+ * Wrapper of display_bst.
+ *
+ * display more information and check error.
+ */
+static void Display_bst()
+{
+    dbg_printf("\n-----displaying-BST--start----\n");
+    for (int i = 0; i < BST_CLASS_COUNT; ++i)
+    {
+        if (bstro[i] == NIL)
+            continue;
+        dbg_printf("class %d : root = %d\n", i, bstro[i]);
+        display_bst(bstro[i]);
+    }
+    dbg_printf("\n-----displaying-BST--finish-----\n");
+}
+
+/*
+ * mm_checkheap
+ *
+ * traversed the heap and check them, display block information.
+ *
+ * display the BST.
+ */
+void mm_checkheap(int verbose)
+{
+    dbg_printf("%s\n", "QAQ, an error has occurred");
+
+    Display_bst();
+
+    dbg_printf("heap : lo = %x  hi = %x   actual size = %d\n",
+        (int)mem_heap_lo(),
+            (int)(mem_get_brk() - 1),
+                (int)mem_heapsize());
+
+    int allocated = 1;
+    for(void *p = heap_pool; p < mem_get_brk(); )
+    {
+        display_block_info(p);
+        assert(aligned(p + HEADER_SIZE));
+        int u = p - heap_pool;
+        int type = get_block_type(p);
+        if (type == BLOCK_ALLOCATED)
+        {
+            allocated = 1;
+            p += get_allocated_block_size(p);
+            continue;
+        }
+
+        assert(allocated);
+        allocated = 0;
+        switch (type)
+        {
+            case BLOCK_8_BYTE:
+                p = p + ALIGNMENT;
+            break;
+
+            case BLOCK_BST_NODE:
+                assert(get_free_block_size(p) > LINKED_LIST_MAX_BLOCK_SIZE);
+                p += get_free_block_size(p);
+            break;
+
+            case BLOCK_LINKED_LIST_NODE:
+                assert(u ==
+                        get_linkedlist_next(
                             heap_pool + get_linkedlist_prev(p)));
                 if (get_linkedlist_next(p) != NIL)
                     assert(u ==
                         get_linkedlist_prev(
                             heap_pool + get_linkedlist_next(p)));
 
-                p += get_free_block_size(p);
-            break;
-            case BLOCK_LINKED_LIST_HEAD:
+                p += get_free_block_size(p);
+            break;
+            case BLOCK_LINKED_LIST_HEAD:
+
+                assert(
+                    linkedlist_pool[
+                        get_linkedlist_head_index(get_free_block_size(p) )]
+                            == u);
+                if (get_linkedlist_next(p) != NIL)
+                    assert(p - heap_pool ==
+                            get_linkedlist_prev(heap_pool
+                        + get_linkedlist_next(p)));
+
+                p += get_free_block_size(p);
+            break;
+        }
+    }
+
+
+    dbg_printf("%s\n",
+        "Ah...  I will terminate right now after traversing the heap.");
+
+    dbg_printf("\n");
+
+    dbg_printf("%s\n", "Wish you goodnight (");
+}
+
+
+static int treap_depth(int u)
+{
+    if (u == NIL)
+        return 0;
+
+    int l = treap_depth(get_Child(u, 0)), r = treap_depth(get_Child(u, 1));
+    return 1 + (l > r ? l : r);
+}
+
+/*
+ * mm_heapstat - walk the heap like mm_checkheap, but only to measure it.
+ *
+ *      The free blocks are counted by size (highest bit), by linked list
+ *      and by the first level of their treap class.
+ */
+void mm_heapstat(mm_heapstat_t *stat)
+{
+    memset(stat, 0, sizeof(*stat));
+    stat->heap = mem_get_brk() - mem_heap_lo();
+
+    for (void *p = heap_pool; p < mem_get_brk(); )
+    {
+        int type = get_block_type(p);
+        int size;
+
+        if (type == BLOCK_ALLOCATED)
+        {
+            ++stat->blocks;
+            p += get_allocated_block_size(p);
+            continue;
+        }
+
+        size = type == BLOCK_8_BYTE ? ALIGNMENT : get_free_block_size(p);
+        p += size;
+
+        ++stat->free_blocks;
+        stat->free_bytes += size;
+        if ((size_t)size > stat->largest)
+            stat->largest = size;
+        ++stat->hist[31 - __builtin_clz(size)];
+
+        if (size > LINKED_LIST_MAX_BLOCK_SIZE)
+            ++stat->treaps[31 - __builtin_clz(size)];
+        else if (size > ALIGNMENT)
+            ++stat->lists[get_linkedlist_head_index(size)];
+    }
+
+    for (int i = 0; i < BST_CLASS_COUNT; ++i)
+    {
+        int depth = treap_depth(bstro[i]);
+        if (depth > stat->treap_depth)
+            stat->treap_depth = depth;
+    }
+}
+
+
+#ifdef LIBMM
+/*
+ *
+ * libmm.so : mm.c as the malloc of a real program, by LD_PRELOAD.
+ *
+ *      The heap is memlib's, set up by the first malloc,
+ *      and mm.c is built THREAD_SAFE. MAX_HEAP is just under the 2GB
+ *      the int offsets can reach; past it, malloc fails with ENOMEM.
+ *
+ *      With LIBMM_STATS in the environment, the peak of the live bytes,
+ *      of the heap and of the mapped regions are written to stderr
+ *      at exit, or on SIGTERM if the program leaves it alone.
+ *
+ *      With LIBMM_PROFILE=<file>, a sample of the blocks is profiled by
+ *      call stack, see libmm_sample.
+ *
+ *      With LIBMM_RECORD=<file>, the requests are written as a trace
+ *      of mdriver, see libmm_record.
+ */
+#undef malloc
+#undef free
+#undef realloc
+#undef calloc
+#undef memalign
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define LIBMM_EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t libmm_once = PTHREAD_ONCE_INIT;
+static int libmm_failed;        /* no heap, every allocation fails */
+static int libmm_stats = -1;    /* fd of the report, or -1 */
+static size_t libmm_live, libmm_live_peak;
+
+/*
+ * the child gets only the forking thread: no lock may be held by another.
+ * memlib's regions lock is innermost, it never waits for the arena lock.
+ */
+static void libmm_fork_prepare(void)
+{
+    pthread_mutex_lock(&arena_lock);
+    mem_lock();
+}
+
+static void libmm_fork_release(void)
+{
+    mem_unlock();
+    pthread_mutex_unlock(&arena_lock);
+}
+
+static void libmm_report(void);
+static void libmm_profile_init(void);
+static void libmm_record_init(void);
+static void libmm_record_dump(void);
+
+/*
+ * servers are stopped by SIGTERM, report before dying of it.
+ */
+static void libmm_term(int sig)
+{
+    libmm_report();
+    libmm_record_dump();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void libmm_init(void)
+{
+    struct sigaction action;
+
+    if (mem_init() < 0 || mm_init() < 0)
+    {
+        libmm_failed = 1;
+        return;
+    }
+    pthread_atfork(libmm_fork_prepare, libmm_fork_release,
+        libmm_fork_release);
+    libmm_profile_init();
+    libmm_record_init();
+    /* a copy of stderr, programs may close it before the destructors */
+    if (getenv("LIBMM_STATS") == NULL)
+        return;
+
+    libmm_stats = fcntl(2, F_DUPFD_CLOEXEC, 3);
+    if (sigaction(SIGTERM, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+        signal(SIGTERM, libmm_term);
+}
+
+/*
+ * count the usable bytes of the live blocks, sign is 1 or -1.
+ */
+static void libmm_account(void *ptr, int sign)
+{
+    size_t live, peak;
+
+    if (ptr == NULL)
+        return;
+
+    live = __atomic_add_fetch(&libmm_live, sign * get_usable_size(ptr),
+        __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&libmm_live_peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&libmm_live_peak,
+        &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ *
+ * Sampling profiler. (LIBMM_PROFILE=<file>, LIBMM_PROFILE_RATE=<bytes>)
+ *
+ *      Every thread counts down the bytes it allocates, and the block that
+ *      takes the count below zero is sampled: its call stack is counted,
+ *      and the next count is drawn from an exponential distribution of mean
+ *      LIBMM_PROFILE_RATE. So a block of s bytes is sampled with probability
+ *      1 - exp(-s / rate), and a malloc that is not sampled only pays for
+ *      the decrement. (pprof scales the samples back by that probability)
+ *
+ *      profile_stacks : the sampled stacks, open addressing on their hash.
+ *                       An entry is claimed by a CAS of its hash, filled,
+ *                       then published, its counts are atomic.
+ *      profile_live   : the sampled blocks still allocated, by address,
+ *                       claimed the same way. A bit per word of the heap
+ *                       (profile_marks) tells free which blocks to look up.
+ *
+ *      The profile is written to <file>.<pid>, in the heap profile format
+ *      of gperftools (pprof reads it), at exit, on SIGUSR2 if the program
+ *      leaves it alone, and whenever the program calls libmm_profile_dump.
+ *      A full table drops the new stacks and blocks, never blocks a thread.
+ */
+#define PROFILE_RATE        (512 << 10)
+#define PROFILE_DEPTH       32
+#define PROFILE_SKIP        2           /* libmm_sample and the malloc */
+#define PROFILE_STACKS      (1 << 12)
+#define PROFILE_LIVE        (1 << 16)
+#define PROFILE_TOMBSTONE   ((void *)1)
+
+struct profile_stack
+{
+    size_t hash;                        /* 0 if empty */
+    int depth, ready;
+    void *pc[PROFILE_DEPTH];
+    size_t alloc_count, alloc_bytes;
+    size_t live_count, live_bytes;
+};
+
+struct profile_block
+{
+    void *ptr;                          /* NULL if empty */
+    struct profile_stack *stack;
+    size_t size;
+};
+
+static const char *libmm_profile;       /* the file, or NULL */
+static double libmm_profile_rate;
+static struct profile_stack *profile_stacks;
+static struct profile_block *profile_live;
+static unsigned long *profile_marks;
+
+static __thread long libmm_sample_left; /* bytes before the next sample */
+static __thread unsigned long libmm_sample_seed;
+static __thread int libmm_sampling;     /* backtrace may malloc */
+
+static void *libmm_profile_map(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void libmm_profile_term(int sig);
+
+static void libmm_profile_init(void)
+{
+    const char *rate = getenv("LIBMM_PROFILE_RATE");
+    struct sigaction action;
+
+    if ((libmm_profile = getenv("LIBMM_PROFILE")) == NULL)
+        return;
+
+    libmm_profile_rate = rate ? atof(rate) : PROFILE_RATE;
+    profile_stacks = libmm_profile_map(
+        PROFILE_STACKS * sizeof(struct profile_stack));
+    profile_live = libmm_profile_map(
+        PROFILE_LIVE * sizeof(struct profile_block));
+    profile_marks = libmm_profile_map(MAX_HEAP / ALIGNMENT / 8);
+    if (libmm_profile_rate <= 0 || !profile_stacks || !profile_live ||
+        !profile_marks)
+    {
+        libmm_profile = NULL;
+        return;
+    }
+
+    if (sigaction(SIGUSR2, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+        signal(SIGUSR2, libmm_profile_term);
+}
+
+/*
+ * bytes before the next sample, exponential of mean libmm_profile_rate.
+ */
+static long libmm_sample_interval(void)
+{
+    unsigned long x = libmm_sample_seed;
+
+    if (x == 0)
+        x = ((unsigned long)&x ^ (unsigned long)time(NULL) << 32) | 1;
+    /* xorshift64 */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    libmm_sample_seed = x;
+
+    /* 53 random bits, uniform in (0, 1] */
+    return (long)(-log(((x >> 11) + 1) * 0x1p-53) * libmm_profile_rate) + 1;
+}
+
+static size_t libmm_stack_hash(void **pc, int depth)
+{
+    size_t h = depth;
+
+    for (int i = 0; i < depth; ++i)
+        h = (h ^ (size_t)pc[i]) * 0x100000001b3ul;
+    return h | 1;
+}
 
-                assert(get_Child(u, 0) == 0);
-                assert(
-                    linkedlist_pool[
-                        get_linkedlist_head_index(get_free_block_size(p) )]
-                            == u);
-                if (get_linkedlist_next(p) != NIL)
-                    assert(p - heap_pool ==
-                            get_linkedlist_prev(heap_pool
-                        + get_linkedlist_next(p)));
+/*
+ * the entry of a stack, claimed if it is new. (or NULL, the table is full)
+ */
+static struct profile_stack *libmm_stack_find(void **pc, int depth)
+{
+    size_t h = libmm_stack_hash(pc, depth);
 
-                p += get_free_block_size(p);
+    for (size_t n = 0, i = h; n < PROFILE_STACKS; ++n, ++i)
+    {
+        struct profile_stack *e = &profile_stacks[i & (PROFILE_STACKS - 1)];
+        size_t cur = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+
+        if (cur == 0)
+        {
+            if (__atomic_compare_exchange_n(&e->hash, &cur, h, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                memcpy(e->pc, pc, depth * sizeof(void *));
+                e->depth = depth;
+                __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+                return e;
+            }
+        }
+        if (cur != h)
+            continue;
+
+        while (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE))
+            ;
+        if (e->depth == depth && memcmp(e->pc, pc, depth * sizeof(void *)) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static inline size_t libmm_block_index(void *ptr)
+{
+    return ((size_t)ptr >> 3) * 0x9e3779b97f4a7c15ul >> 48;
+}
+
+static inline size_t libmm_mark_index(void *ptr)
+{
+    return (ptr - mem_heap_lo()) / ALIGNMENT;
+}
+
+/*
+ * the block was sampled, remember it until it is freed.
+ */
+static void libmm_block_insert(void *ptr, struct profile_stack *stack,
+    size_t size)
+{
+    size_t i = libmm_block_index(ptr);
+
+    for (size_t n = 0; n < PROFILE_LIVE; ++n, ++i)
+    {
+        struct profile_block *b = &profile_live[i & (PROFILE_LIVE - 1)];
+        void *cur = __atomic_load_n(&b->ptr, __ATOMIC_RELAXED);
+
+        if ((cur == NULL || cur == PROFILE_TOMBSTONE) &&
+            __atomic_compare_exchange_n(&b->ptr, &cur, ptr, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            b->stack = stack;
+            b->size = size;
+            __atomic_add_fetch(&stack->live_count, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stack->live_bytes, size, __ATOMIC_RELAXED);
+            if (in_heap(ptr))
+            {
+                size_t m = libmm_mark_index(ptr);
+                __atomic_or_fetch(&profile_marks[m / 64], 1ul << m % 64,
+                    __ATOMIC_RELEASE);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * free of a block : forget it if it was sampled.
+ */
+static void libmm_unsample(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    if (in_heap(ptr))
+    {
+        size_t m = libmm_mark_index(ptr);
+
+        if (!(__atomic_load_n(&profile_marks[m / 64], __ATOMIC_ACQUIRE)
+            & 1ul << m % 64))
+            return;
+        __atomic_and_fetch(&profile_marks[m / 64], ~(1ul << m % 64),
+            __ATOMIC_RELAXED);
+    }
+
+    size_t i = libmm_block_index(ptr);
+
+    for (size_t n = 0; n < PROFILE_LIVE; ++n, ++i)
+    {
+        struct profile_block *b = &profile_live[i & (PROFILE_LIVE - 1)];
+        void *cur = __atomic_load_n(&b->ptr, __ATOMIC_ACQUIRE);
+
+        if (cur == NULL)
+            return;
+        if (cur != ptr)
+            continue;
+
+        __atomic_sub_fetch(&b->stack->live_count, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&b->stack->live_bytes, b->size, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->ptr, PROFILE_TOMBSTONE, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+/*
+ * the slow path of the countdown : sample the block just allocated,
+ *      and draw the next countdown. (off for good without LIBMM_PROFILE)
+ */
+static void __attribute__((noinline)) libmm_sample(void *ptr, size_t size)
+{
+    void *pc[PROFILE_DEPTH + PROFILE_SKIP];
+    struct profile_stack *stack;
+    int depth;
+
+    if (libmm_profile == NULL)
+    {
+        libmm_sample_left = LONG_MAX;
+        return;
+    }
+    if (libmm_sampling)
+        return;
+
+    libmm_sampling = 1;
+    libmm_sample_left = libmm_sample_interval();
+    depth = backtrace(pc, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+    if (depth > 0 && (stack = libmm_stack_find(pc + PROFILE_SKIP, depth)))
+    {
+        __atomic_add_fetch(&stack->alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stack->alloc_bytes, size, __ATOMIC_RELAXED);
+        libmm_block_insert(ptr, stack, size);
+    }
+    libmm_sampling = 0;
+}
+
+/*
+ * write the profile to its file, the stacks sampled so far:
+ *
+ *      heap profile: <live>: <bytes> [<allocated>: <bytes>] @ heap_v2/<rate>
+ *      <live>: <bytes> [<allocated>: <bytes>] @ <pc> <pc> ...
+ *      ...
+ *      MAPPED_LIBRARIES:
+ *      <a copy of /proc/self/maps>
+ */
+LIBMM_EXPORT int libmm_profile_dump(void)
+{
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    char buf[1024];
+    int fd, maps, n;
+
+    if (libmm_profile == NULL)
+        return -1;
+    /* a child of fork or exec has a profile of its own */
+    snprintf(buf, sizeof(buf), "%s.%d", libmm_profile, (int)getpid());
+    if ((fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+
+    for (int i = 0; i < PROFILE_STACKS; ++i)
+    {
+        struct profile_stack *e = &profile_stacks[i];
+
+        if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE))
+            continue;
+        live_count += e->live_count, live_bytes += e->live_bytes;
+        alloc_count += e->alloc_count, alloc_bytes += e->alloc_bytes;
+    }
+    n = snprintf(buf, sizeof(buf),
+        "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%.0f\n",
+        live_count, live_bytes, alloc_count, alloc_bytes, libmm_profile_rate);
+    if (write(fd, buf, n) < 0)
+        goto out;
+
+    for (int i = 0; i < PROFILE_STACKS; ++i)
+    {
+        struct profile_stack *e = &profile_stacks[i];
+
+        if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE))
+            continue;
+        n = snprintf(buf, sizeof(buf), "%zu: %zu [%zu: %zu] @",
+            e->live_count, e->live_bytes, e->alloc_count, e->alloc_bytes);
+        for (int j = 0; j < e->depth; ++j)
+            n += snprintf(buf + n, sizeof(buf) - n, " %p", e->pc[j]);
+        buf[n++] = '\n';
+        if (write(fd, buf, n) < 0)
+            goto out;
+    }
+
+    if (write(fd, "\nMAPPED_LIBRARIES:\n", 19) < 0)
+        goto out;
+    if ((maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC)) >= 0)
+    {
+        while ((n = read(maps, buf, sizeof(buf))) > 0 && write(fd, buf, n) == n)
+            ;
+        close(maps);
+    }
+out:
+    close(fd);
+    return 0;
+}
+
+static void libmm_profile_term(int sig)
+{
+    libmm_profile_dump();
+}
+
+static void __attribute__((destructor)) libmm_profile_exit(void)
+{
+    libmm_profile_dump();
+}
+
+/*
+ *
+ * Trace recorder. (LIBMM_RECORD=<file>)
+ *
+ *      The requests of the program are written to <file>.<pid> at exit,
+ *      or on SIGTERM, as a trace of mdriver. (mdriver -f <file>.<pid>)
+ *
+ *      Every request takes a number from record_seq, a free before it
+ *      lets the block go and an allocation once it has it, so in the
+ *      order of the numbers no block is handed out while it is live,
+ *      whatever the threads. A realloc takes one at each end.
+ *      The request is then appended to a chunk of its thread, no lock:
+ *      a thread maps a chunk of its own and pushes it on record_chunks
+ *      by a CAS.
+ *
+ *      At exit, the requests are put back in order by their numbers
+ *      (record_slot), and the pointers are renamed to block ids 0, 1, 2 ...
+ *      by a table on their address, a new id for every allocation,
+ *      that its reallocs keep. A request still running, and a block
+ *      too large for mdriver (over INT_MAX bytes), are left out.
+ */
+#define RECORD_CHUNK        (1 << 14)   /* requests in a chunk */
+
+struct record_op
+{
+    unsigned long seq, seq_end;         /* seq_end : realloc only */
+    void *ptr, *new_ptr;                /* new_ptr : realloc only */
+    size_t size, align;
+    char type;                          /* 'a', 'c', 'm', 'r' or 'f' */
+};
+
+struct record_chunk
+{
+    struct record_chunk *next;
+    int count;                          /* published with a release */
+    struct record_op op[RECORD_CHUNK];
+};
+
+/*
+ * a request in the order of the numbers. The old block of a realloc
+ *      is an 'R', its size the number of the 'r'.
+ */
+struct record_slot
+{
+    void *ptr;
+    size_t size;
+    unsigned align;
+    int id;
+    char type;                          /* 0 if the request is missing */
+};
+
+struct record_block
+{
+    void *ptr;                          /* NULL if empty */
+    int id;
+};
+
+static const char *libmm_record_file;   /* or NULL */
+static int libmm_recording;
+static unsigned long record_seq;
+static struct record_chunk *record_chunks;
+static __thread struct record_chunk *record_chunk;
+
+static void libmm_record_init(void)
+{
+    struct sigaction action;
+
+    if ((libmm_record_file = getenv("LIBMM_RECORD")) == NULL)
+        return;
+
+    libmm_recording = 1;
+    if (sigaction(SIGTERM, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+        signal(SIGTERM, libmm_term);
+}
+
+static inline unsigned long libmm_record_next(void)
+{
+    return __atomic_fetch_add(&record_seq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * append a request to the chunk of the thread, numbered seq
+ *      (and seq_end for a realloc).
+ */
+static void libmm_record(char type, unsigned long seq, unsigned long seq_end,
+    void *ptr, void *new_ptr, size_t size, size_t align)
+{
+    struct record_chunk *chunk = record_chunk;
+    struct record_op *op;
+
+    if (chunk == NULL || chunk->count == RECORD_CHUNK)
+    {
+        if ((chunk = libmm_profile_map(sizeof(struct record_chunk))) == NULL)
+            return;
+        chunk->next = __atomic_load_n(&record_chunks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&record_chunks, &chunk->next,
+            chunk, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        record_chunk = chunk;
+    }
+
+    op = &chunk->op[chunk->count];
+    op->seq = seq, op->seq_end = seq_end;
+    op->ptr = ptr, op->new_ptr = new_ptr;
+    op->size = size, op->align = align;
+    op->type = type;
+    __atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+}
+
+static inline size_t libmm_record_index(void *ptr, int bits)
+{
+    return ((size_t)ptr >> 3) * 0x9e3779b97f4a7c15ul >> (64 - bits);
+}
+
+/*
+ * the entry of a block in the table, or the empty one it would take.
+ *      (the table is at least twice the allocations, never full)
+ */
+static struct record_block *libmm_record_find(struct record_block *table,
+    int bits, void *ptr)
+{
+    struct record_block *tomb = NULL;
+
+    for (size_t i = libmm_record_index(ptr, bits); ; ++i)
+    {
+        struct record_block *b = &table[i & ((1ul << bits) - 1)];
+
+        if (b->ptr == ptr)
+            return b;
+        if (b->ptr == PROFILE_TOMBSTONE && tomb == NULL)
+            tomb = b;
+        if (b->ptr == NULL)
+            return tomb ? tomb : b;
+    }
+}
+
+/*
+ * rename the blocks of the requests in order to ids, in place :
+ *      slot[j] is the jth request of the trace. Return their number.
+ */
+static long libmm_record_rename(struct record_slot *slot, unsigned long n,
+    struct record_block *table, int bits, int *num_ids)
+{
+    struct record_block *b;
+    long j = 0;
+
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        struct record_slot s = slot[i];
+
+        switch (s.type)
+        {
+        case 'a': case 'c': case 'm':
+            if (s.size > INT_MAX)
+                continue;
+            b = libmm_record_find(table, bits, s.ptr);
+            b->ptr = s.ptr, b->id = s.id = (*num_ids)++;
+            break;
+        case 'f':
+            if ((b = libmm_record_find(table, bits, s.ptr))->ptr != s.ptr)
+                continue;
+            b->ptr = PROFILE_TOMBSTONE, s.id = b->id;
+            break;
+        case 'R':
+            /* the old block goes, its id waits in the 'r' */
+            if (s.size >= n || slot[s.size].type != 'r')
+                continue;
+            if ((b = libmm_record_find(table, bits, s.ptr))->ptr != s.ptr)
+                continue;
+            b->ptr = PROFILE_TOMBSTONE, slot[s.size].id = b->id;
+            continue;
+        case 'r':
+            if (s.id < 0)
+            {
+                s.type = 'a';
+                if (s.size > INT_MAX)
+                    continue;
+                s.id = (*num_ids)++;
+            }
+            else if (s.size > INT_MAX)
+            {
+                s.type = 'f';
+                break;
+            }
+            b = libmm_record_find(table, bits, s.ptr);
+            b->ptr = s.ptr, b->id = s.id;
             break;
+        default:
+            continue;
         }
+        slot[j++] = s;
     }
+    return j;
+}
 
+static void libmm_record_write(int fd, struct record_slot *slot, long n,
+    int num_ids)
+{
+    char buf[1 << 16];
+    int len;
 
-    dbg_printf("%s\n",
-        "Ah...  I will terminate right now after traversing the heap.");
+    len = snprintf(buf, sizeof(buf), "1\n%d\n%ld\n0\n", num_ids, n);
+    for (long i = 0; i < n; ++i)
+    {
+        if (slot[i].type == 'f')
+            len += snprintf(buf + len, sizeof(buf) - len, "f %d\n",
+                slot[i].id);
+        else if (slot[i].type == 'm')
+            len += snprintf(buf + len, sizeof(buf) - len, "m %d %zu %u\n",
+                slot[i].id, slot[i].size, slot[i].align);
+        else
+            len += snprintf(buf + len, sizeof(buf) - len, "%c %d %zu\n",
+                slot[i].type, slot[i].id, slot[i].size);
+        if (len > (int)sizeof(buf) - 64)
+        {
+            if (write(fd, buf, len) < 0)
+                return;
+            len = 0;
+        }
+    }
+    if (write(fd, buf, len) < 0)
+        return;
+}
 
-    dbg_printf("\n");
+/*
+ * stop recording and write the trace, once.
+ */
+static void libmm_record_dump(void)
+{
+    struct record_slot *slot;
+    struct record_block *table;
+    unsigned long n;
+    int bits, num_ids = 0, fd;
+    long num_ops;
+    char name[PATH_MAX];
+
+    if (!__atomic_exchange_n(&libmm_recording, 0, __ATOMIC_ACQ_REL))
+        return;
 
-    dbg_printf("%s\n", "Wish you goodnight (");
+    n = __atomic_load_n(&record_seq, __ATOMIC_ACQUIRE);
+    for (bits = 4; (1ul << bits) < 2 * n; ++bits)
+        ;
+    slot = libmm_profile_map((n + 1) * sizeof(struct record_slot));
+    table = libmm_profile_map(sizeof(struct record_block) << bits);
+    if (slot == NULL || table == NULL)
+        return;
+
+    for (struct record_chunk *chunk = __atomic_load_n(&record_chunks,
+        __ATOMIC_ACQUIRE); chunk; chunk = chunk->next)
+    {
+        int count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+
+        for (int i = 0; i < count; ++i)
+        {
+            struct record_op *op = &chunk->op[i];
+
+            if (op->seq >= n || (op->type == 'r' && op->seq_end >= n))
+                continue;
+            if (op->type == 'r')
+            {
+                slot[op->seq] = (struct record_slot)
+                    {op->ptr, op->seq_end, 0, -1, 'R'};
+                slot[op->seq_end] = (struct record_slot)
+                    {op->new_ptr, op->size, 0, -1, 'r'};
+            }
+            else
+                slot[op->seq] = (struct record_slot)
+                    {op->ptr, op->size, op->align, -1, op->type};
+        }
+    }
+    num_ops = libmm_record_rename(slot, n, table, bits, &num_ids);
+
+    /* a child of fork or exec has a trace of its own */
+    snprintf(name, sizeof(name), "%s.%d", libmm_record_file, (int)getpid());
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0)
+    {
+        libmm_record_write(fd, slot, num_ops, num_ids);
+        close(fd);
+    }
+    munmap(slot, (n + 1) * sizeof(struct record_slot));
+    munmap(table, sizeof(struct record_block) << bits);
+}
+
+static void __attribute__((destructor)) libmm_record_exit(void)
+{
+    libmm_record_dump();
+}
+
+static void __attribute__((destructor)) libmm_report(void)
+{
+    char buf[256];
+    size_t heap, mapped;
+    int n;
+
+    if (libmm_stats < 0)
+        return;
+
+    heap = mem_heapsize_peak();
+    mapped = mem_mapped_peak();
+    n = snprintf(buf, sizeof(buf),
+        "libmm: live peak %zu KB, heap peak %zu KB, mapped peak %zu KB, "
+        "fragmentation %.1f%%\n",
+        libmm_live_peak >> 10, heap >> 10, mapped >> 10,
+        heap + mapped ? 100.0 - 100.0 * libmm_live_peak / (heap + mapped) : 0);
+    if (write(libmm_stats, buf, n) < 0)
+        return;
+}
+
+/*
+ * every block is a unique pointer, malloc(0) included.
+ */
+LIBMM_EXPORT void *malloc(size_t size)
+{
+    void *ptr;
+
+    pthread_once(&libmm_once, libmm_init);
+    if (libmm_failed)
+        return errno = ENOMEM, NULL;
+    if ((ptr = mm_malloc(size ? size : 1)) == NULL)
+        return errno = ENOMEM, NULL;
+    if (libmm_recording)
+        libmm_record('a', libmm_record_next(), 0, ptr, NULL,
+            size ? size : 1, 0);
+    if (libmm_stats >= 0)
+        libmm_account(ptr, 1);
+    if ((libmm_sample_left -= size) < 0)
+        libmm_sample(ptr, size);
+    return ptr;
+}
+
+LIBMM_EXPORT void free(void *ptr)
+{
+    if (libmm_recording && ptr != NULL)
+        libmm_record('f', libmm_record_next(), 0, ptr, NULL, 0, 0);
+    if (libmm_stats >= 0)
+        libmm_account(ptr, -1);
+    if (profile_marks != NULL)
+        libmm_unsample(ptr);
+    mm_free(ptr);
+}
+
+LIBMM_EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *new_ptr;
+    unsigned long seq = 0;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0)
+        return free(ptr), NULL;
+
+    if (libmm_recording)
+        seq = libmm_record_next();
+    if (libmm_stats >= 0)
+        libmm_account(ptr, -1);
+    if (profile_marks != NULL)
+        libmm_unsample(ptr);
+    if ((new_ptr = mm_realloc(ptr, size)) == NULL)
+        errno = ENOMEM;
+    else if (libmm_recording)
+        libmm_record('r', seq, libmm_record_next(), ptr, new_ptr, size, 0);
+    if (libmm_stats >= 0)
+        libmm_account(new_ptr ? new_ptr : ptr, 1);
+    if (new_ptr && (libmm_sample_left -= size) < 0)
+        libmm_sample(new_ptr, size);
+    return new_ptr;
+}
+
+LIBMM_EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    pthread_once(&libmm_once, libmm_init);
+    if (libmm_failed || (size && nmemb > SIZE_MAX / size))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (nmemb == 0 || size == 0)
+        nmemb = size = 1;
+    if ((ptr = mm_calloc(nmemb, size)) == NULL)
+        return errno = ENOMEM, NULL;
+    if (libmm_recording)
+        libmm_record('c', libmm_record_next(), 0, ptr, NULL, nmemb * size, 0);
+    if (libmm_stats >= 0)
+        libmm_account(ptr, 1);
+    if ((libmm_sample_left -= nmemb * size) < 0)
+        libmm_sample(ptr, nmemb * size);
+    return ptr;
+}
+
+LIBMM_EXPORT void *memalign(size_t alignment, size_t size)
+{
+    void *ptr;
+
+    pthread_once(&libmm_once, libmm_init);
+    if (libmm_failed)
+        return errno = ENOMEM, NULL;
+    if ((ptr = mm_memalign(alignment, size ? size : 1)) == NULL)
+        return errno = alignment & (alignment - 1) ? EINVAL : ENOMEM, NULL;
+    if (libmm_recording)
+        libmm_record('m', libmm_record_next(), 0, ptr, NULL,
+            size ? size : 1, alignment);
+    if (libmm_stats >= 0)
+        libmm_account(ptr, 1);
+    if ((libmm_sample_left -= size) < 0)
+        libmm_sample(ptr, size);
+    return ptr;
+}
+
+LIBMM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if ((ptr = memalign(alignment, size)) == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+LIBMM_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+LIBMM_EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+LIBMM_EXPORT void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+LIBMM_EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return get_usable_size(ptr);
 }
+#endif /* def LIBMM */
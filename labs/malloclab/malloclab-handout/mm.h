@@ -7,6 +7,8 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_malloc_hint(size_t size, int lifetime);
 
 #else
 
@@ -15,10 +17,53 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *malloc_hint(size_t size, int lifetime);
 
 #endif
 
+/* How long a block is expected to live, for malloc_hint */
+#define MM_LIFETIME_DEFAULT 0   /* as malloc, in the heap itself */
+#define MM_LIFETIME_SHORT   1   /* freed within a few requests */
+#define MM_LIFETIME_MEDIUM  2
+#define MM_LIFETIMES        3
+
 extern int mm_init(void);
 
 /* This is largely for debugging. */
 extern void mm_checkheap(int lineno);
+
+/* The shape of the heap, for profiling (see mdriver -F) */
+#define MM_STAT_CLASSES 32
+typedef struct {
+    size_t heap;         /* bytes below the brk */
+    size_t free_bytes;   /* bytes in free blocks */
+    size_t largest;      /* the largest free block */
+    int blocks;          /* allocated blocks */
+    int free_blocks;
+    int hist[MM_STAT_CLASSES];   /* free blocks by highest bit of size */
+    int lists[MM_STAT_CLASSES];  /* free blocks in each linked list */
+    int treaps[MM_STAT_CLASSES]; /* free blocks in the treaps of a level */
+    int treap_depth;     /* of the deepest treap */
+} mm_heapstat_t;
+
+extern void mm_heapstat(mm_heapstat_t *stat);
+
+/*
+ * Arenas, for blocks that all die together (e.g. with a request):
+ * bumped out of chunks of the heap, and freed by one reset or destroy.
+ * Their blocks are never passed to free, and an arena is not shared
+ * between threads.
+ */
+typedef struct mm_arena mm_arena_t;
+typedef struct {
+    void *chunk;
+    char *top;
+} mm_arena_scope_t;      /* where a nested scope began */
+
+extern mm_arena_t *mm_arena_create(void);
+extern void *mm_arena_malloc(mm_arena_t *arena, size_t size);
+extern mm_arena_scope_t mm_arena_enter(mm_arena_t *arena);
+extern void mm_arena_leave(mm_arena_t *arena, mm_arena_scope_t scope);
+extern void mm_arena_reset(mm_arena_t *arena);
+extern void mm_arena_destroy(mm_arena_t *arena);